@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "utilities.hpp"
+#include "tasks.hpp"
+#include "bsp.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "obj.hpp"
+#include "cache.hpp"
+
+// Headless benchmark: loads OBJ files as models, builds the BSP and renders a
+// camera path into an offscreen surface, then prints one JSON object.
+
+typedef struct bench_args {
+  std::vector<const char *> files;
+  const char *path;
+  const char *cache;
+  u32 frames;
+  f32 spread;
+  bsp_options build;
+  bool serial;
+  u32 raster;
+  bool tiled;
+  bool nearest_first;
+  f32 scale;
+  bool bilinear;
+  bool wide;
+} bench_args;
+
+void usage() {
+  fprintf(stderr,
+	  "usage: bench [options] model.obj...\n"
+	  "  --frames N              frames to render (240)\n"
+	  "  --path FILE             camera path, one \"x y z yaw roll\" line per frame\n"
+	  "  --spread D              place model i at x = i * D\n"
+	  "  --cache FILE            load the compiled scene from FILE, or build and save it\n"
+	  "  --splitter best|sampled|fast\n"
+	  "  --no-merge              build from the triangles as they are\n"
+	  "  --split-weight W        cost per triangle a cut adds (1)\n"
+	  "  --balance-weight W      cost per polygon of front/back imbalance (0)\n"
+	  "  --serial                build and render without the task pool\n"
+	  "  --raster scanline|halfspace\n"
+	  "  --no-tiles              rasterize on one thread\n"
+	  "  --front-to-back         nearest-first traversal with coverage\n"
+	  "  --scale S               render at S times the window size and upscale (1)\n"
+	  "  --nearest               upscale without filtering\n"
+	  "  --wide                  render from 32-bit indices even when the scene fits in 16\n");
+}
+
+bool parse_args(int argc, char **argv, bench_args& args) {
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    bool more = i + 1 < argc;
+    if (!strcmp(a, "--frames") && more) {
+      args.frames = atoi(argv[++i]);
+    } else if (!strcmp(a, "--path") && more) {
+      args.path = argv[++i];
+    } else if (!strcmp(a, "--spread") && more) {
+      args.spread = atof(argv[++i]);
+    } else if (!strcmp(a, "--cache") && more) {
+      args.cache = argv[++i];
+    } else if (!strcmp(a, "--splitter") && more) {
+      const char *s = argv[++i];
+      if (!strcmp(s, "best")) args.build.splitter = SPLITTER_BEST;
+      else if (!strcmp(s, "sampled")) args.build.splitter = SPLITTER_SAMPLE;
+      else if (!strcmp(s, "fast")) args.build.splitter = SPLITTER_FAST;
+      else return false;
+    } else if (!strcmp(a, "--no-merge")) {
+      args.build.merge = false;
+    } else if (!strcmp(a, "--split-weight") && more) {
+      args.build.split_weight = atof(argv[++i]);
+    } else if (!strcmp(a, "--balance-weight") && more) {
+      args.build.balance_weight = atof(argv[++i]);
+    } else if (!strcmp(a, "--serial")) {
+      args.serial = true;
+    } else if (!strcmp(a, "--raster") && more) {
+      const char *s = argv[++i];
+      if (!strcmp(s, "scanline")) args.raster = RASTER_SCANLINE;
+      else if (!strcmp(s, "halfspace")) args.raster = RASTER_HALFSPACE;
+      else return false;
+    } else if (!strcmp(a, "--no-tiles")) {
+      args.tiled = false;
+    } else if (!strcmp(a, "--front-to-back")) {
+      args.nearest_first = true;
+    } else if (!strcmp(a, "--scale") && more) {
+      f32 scale = atof(argv[++i]);
+      args.scale = MIN(MAX(scale, RENDER_SCALE_MIN), 1.0f);
+    } else if (!strcmp(a, "--nearest")) {
+      args.bilinear = false;
+    } else if (!strcmp(a, "--wide")) {
+      args.wide = true;
+    } else if (a[0] == '-') {
+      return false;
+    } else {
+      args.files.push_back(a);
+    }
+  }
+  return args.files.size() && args.frames;
+}
+
+// Camera positions are the negated eye, as in main.
+bool load_path(const char *file, std::vector<camera>& path, camera base) {
+  FILE *f = fopen(file, "r");
+  if (!f) return false;
+  f32 x, y, z, yaw, roll;
+  while (fscanf(f, " %f %f %f %f %f", &x, &y, &z, &yaw, &roll) == 5) {
+    camera c = base;
+    c.pos = cons3(x, y, z);
+    c.rot = cons3(0, yaw, roll);
+    path.push_back(c);
+  }
+  fclose(f);
+  return path.size();
+}
+
+// Flies from well outside the scene's bounds to near its centre while
+// sweeping the view from side to side.
+void script_path(std::vector<camera>& path, camera base, bsp_view& scene, u32 frames) {
+  const vec3 *points = scene.points;
+  vec3 lo = scene.point_count ? points[0] : cons3(0, 0, 0);
+  vec3 hi = lo;
+  for (usize i = 1; i < scene.point_count; i++) {
+    lo = cons3(MIN(lo.x, points[i].x), MIN(lo.y, points[i].y), MIN(lo.z, points[i].z));
+    hi = cons3(MAX(hi.x, points[i].x), MAX(hi.y, points[i].y), MAX(hi.z, points[i].z));
+  }
+  vec3 centre = mul3(add3(lo, hi), 0.5);
+  f32 radius = MAX(hypot3(sub3(hi, lo)) * 0.5, 1e-3);
+  for (u32 i = 0; i < frames; i++) {
+    f32 t = frames > 1 ? (f32) i / (frames - 1) : 0;
+    camera c = base;
+    c.pos = mul3(add3(centre, cons3(0, 0, radius * (2.5 - 2.2 * t))), -1);
+    c.rot = cons3(0, 0.5 * sin(6.28318 * t), 0);
+    path.push_back(c);
+  }
+}
+
+f64 percentile(std::vector<f64>& sorted, f64 q) {
+  usize i = (usize) ceil(q * sorted.size());
+  return sorted[MIN(MAX(i, 1), sorted.size()) - 1];
+}
+
+int main(int argc, char **argv) {
+  bench_args args = {};
+  args.frames = 240;
+  args.build = (bsp_options) { SPLITTER_BEST, 64, 512, 1.1, true, 1, 0 };
+  args.raster = RASTER_SCANLINE;
+  args.tiled = true;
+  args.scale = 1;
+  args.bilinear = true;
+  if (!parse_args(argc, argv, args)) {
+    usage();
+    return 2;
+  }
+
+  task_pool pool;
+  pool_init(pool, MAX(std::thread::hardware_concurrency(), 2) - 1);
+  std::vector<model> models = {};
+  for (usize i = 0; i < args.files.size(); i++) {
+    std::vector<vec3> points = {};
+    std::vector<triangle> tris = {};
+    u8 error = load_obj(args.files[i], points, tris, &pool);
+    if (error) {
+      fprintf(stderr, "%s: load error %u\n", args.files[i], error);
+      pool_destroy(pool);
+      return 1;
+    }
+    models.push_back(new_model("", points, tris, cons3(args.spread * i, 0, 0)));
+  }
+
+  task_pool *use = args.serial ? NULL : &pool;
+
+  usize scene_points = 0;
+  usize scene_tris = 0;
+  for (usize i = 0; i < models.size(); i++) {
+    scene_points += models[i].mesh->points.size();
+    scene_tris += models[i].mesh->tris.size();
+  }
+
+  // With --cache, build_ms is the time to get a usable scene either way.
+  auto start = std::chrono::steady_clock::now();
+  u64 key = args.cache ? scene_key(models, args.build) : 0;
+  mapped_file cache_file = {};
+  scene_tree world = {};
+  bsp_view scene = {};
+  bool cached = args.cache && load_bsp_cache(args.cache, key, cache_file, scene);
+  if (cached) {
+    load_cached_trees(cache_file, models, world, args.build);
+  } else {
+    assemble_scene(world, models, args.build, use, NULL);
+    scene = view_bsp(world.points, world.tree);
+    if (args.cache && !save_bsp_cache(args.cache, key, scene, models, world)) {
+      fprintf(stderr, "%s: could not write the cache\n", args.cache);
+    }
+  }
+  f64 build_ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  // What dragging the first model costs once every model has its own tree,
+  // built or loaded with the scene. Like the viewer's snapshot, the result is
+  // compacted when it fits.
+  f64 update_ms = -1;
+  bool compact = false;
+  if (models.size()) {
+    start = std::chrono::steady_clock::now();
+    models[0].pos.y += 1e-3;
+    models[0].matrix = model_matrix(models[0]);
+    assemble_scene(world, models, args.build, use, NULL);
+    compact = !args.wide && compact_bsp(world.tree, world.points.size());
+    scene = view_bsp(world.points, world.tree);
+    update_ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  camera base = (camera) { cons3(0, 0, -5), cons3(0, 0, 0), cons3(0,0,0), mul4x4(translate(cons3(0.5, 0.5, 0)), perspective) };
+  std::vector<camera> path = {};
+  if (args.path) {
+    if (!load_path(args.path, path, base)) {
+      fprintf(stderr, "%s: no camera path\n", args.path);
+      unmap_file(cache_file);
+      pool_destroy(pool);
+      return 1;
+    }
+  } else {
+    script_path(path, base, scene, args.frames);
+  }
+
+  // Frames are handed over and presented into an offscreen surface, as the
+  // viewer and the editor do into the window's.
+  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, RWINDOW_WIDTH, RWINDOW_HEIGHT, 32, SDL_PIXELFORMAT_RGB888);
+  framebuffer fb = {};
+  framebuffer shown = {};
+  framebuffer_init(fb, render_size(RWINDOW_WIDTH, args.scale), render_size(RWINDOW_HEIGHT, args.scale), surface->format);
+  framebuffer_init(shown, RWINDOW_WIDTH, RWINDOW_HEIGHT, surface->format);
+  frame_begin(shown, 0);
+  bool scaled = fb.width != RWINDOW_WIDTH || fb.height != RWINDOW_HEIGHT;
+  std::vector<SDL_Rect> rects = {};
+  render_state rs = {};
+  rs.pool = use;
+  rs.raster = args.raster;
+  rs.tiled = args.tiled;
+  rs.nearest_first = args.nearest_first;
+
+  std::vector<f64> frame_ms = {};
+  f64 work[PROFILE_SERIES] = {};
+  for (usize i = 0; i < path.size(); i++) {
+    auto frame = std::chrono::steady_clock::now();
+    rs.profile = (frame_profile) {};
+    frame_begin(fb, 0);
+    render_model(fb, rs, scene, path[i]);
+    if (scaled) {
+      frame_upscale(fb, shown, args.bilinear, use);
+    } else {
+      frame_copy(fb, shown);
+    }
+    frame_present(shown, surface, rects);
+    frame_ms.push_back(std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - frame).count());
+    for (u32 s = PROFILE_NODES; s <= PROFILE_PIXELS; s++) {
+      work[s] += rs.profile.values[s];
+    }
+  }
+  std::sort(frame_ms.begin(), frame_ms.end());
+  f64 total = 0;
+  for (usize i = 0; i < frame_ms.size(); i++) {
+    total += frame_ms[i];
+  }
+
+  bsp_metrics m = measure_bsp(scene, scene_points, scene_tris);
+  printf("{\"points\": %zu, \"triangles\": %zu, \"cached\": %s, \"compact\": %s, \"build_ms\": %.3f, \"update_ms\": %.3f, \"nodes\": %u, "
+	 "\"leaves\": %u, \"depth_max\": %u, \"depth_mean\": %.3f, "
+	 "\"bsp_triangles\": %u, \"amplification\": %.4f, \"split_vertices\": %u, \"render_width\": %d, \"render_height\": %d, \"frames\": %zu, "
+	 "\"frame_mean_ms\": %.3f, \"frame_p50_ms\": %.3f, \"frame_p95_ms\": %.3f, \"frame_p99_ms\": %.3f, "
+	 "\"nodes_visited_mean\": %.1f, \"triangles_drawn_mean\": %.1f, \"pixels_written_mean\": %.1f}\n",
+	 scene_points, scene_tris, cached ? "true" : "false", compact ? "true" : "false", build_ms, update_ms, m.nodes,
+	 m.leaves, m.max_depth, m.mean_depth,
+	 m.triangles, m.amplification, m.split_vertices, fb.width, fb.height, frame_ms.size(),
+	 total / frame_ms.size(), percentile(frame_ms, 0.5), percentile(frame_ms, 0.95), percentile(frame_ms, 0.99),
+	 work[PROFILE_NODES] / frame_ms.size(), work[PROFILE_TRIANGLES] / frame_ms.size(), work[PROFILE_PIXELS] / frame_ms.size());
+
+  framebuffer_free(fb);
+  framebuffer_free(shown);
+  SDL_FreeSurface(surface);
+  unmap_file(cache_file);
+  pool_destroy(pool);
+  return 0;
+}
@@ -0,0 +1,1114 @@
+#pragma once
+
+#include <float.h>
+#include <memory>
+#include <vector>
+#include "utilities.hpp"
+#include "tasks.hpp"
+#include "classify.hpp"
+
+// 16 bytes, so four fit a cache line.
+typedef struct triangle {
+  u32 p0, p1, p2;
+  u32 color; // 0x00RRGGBB, as SDL_PIXELFORMAT_RGB888 stores it
+} triangle;
+
+u32 pack_color(f32 red, f32 green, f32 blue) {
+  return (u32) (u8) (red * 255) << 16 | (u32) (u8) (green * 255) << 8 | (u8) (blue * 255);
+}
+
+void unpack_color(u32 color, f32 *rgb) {
+  rgb[0] = (color >> 16 & 0xff) / 255.0f;
+  rgb[1] = (color >> 8 & 0xff) / 255.0f;
+  rgb[2] = (color & 0xff) / 255.0f;
+}
+
+#define POLY_MAX 8
+
+// What the builder works on: a convex, planar polygon wound the way the
+// triangles it was made from were. The tree it lays out holds each one as a
+// fan of triangles from corner 0 again.
+typedef struct polygon {
+  u32 p[POLY_MAX];
+  u32 count;
+  u32 color;
+} polygon;
+
+#define BSP_NONE 0xffffffffu
+
+typedef struct bsp_node {
+  vec4 plane;
+  u32 first, count; // the node's triangles in bsp_tree::tris
+  u32 front, back;  // child nodes, BSP_NONE when there is none
+  vec3 lo, hi;      // bounds of every triangle in the subtree
+} bsp_node;
+
+// A triangle and a node of a small tree, whose points, nodes and triangles
+// each number at most BSP_COMPACT_MAX: 12 bytes and 48 instead of 16 and 64.
+#define BSP_NONE16 0xffffu
+#define BSP_COMPACT_MAX 0xffffu
+
+typedef struct triangle16 {
+  u16 p0, p1, p2;
+  u32 color;
+} triangle16;
+
+typedef struct bsp_node16 {
+  vec4 plane;
+  u16 first, count;
+  u16 front, back; // BSP_NONE16 when there is none
+  vec3 lo, hi;
+} bsp_node16;
+
+// All nodes in one array and all triangles in another, node 0 is the root.
+// Dropping a tree frees everything at once. A compacted tree keeps them in
+// `nodes16` and `tris16` instead and leaves `nodes` and `tris` empty; read it
+// through bsp_node_count, bsp_node_at and the like.
+typedef struct bsp_tree {
+  std::vector<bsp_node> nodes;
+  std::vector<triangle> tris;
+  std::vector<bsp_node16> nodes16;
+  std::vector<triangle16> tris16;
+} bsp_tree;
+
+u16 narrow_link(u32 node) {
+  return node == BSP_NONE ? BSP_NONE16 : node;
+}
+
+u32 widen_link(u16 node) {
+  return node == BSP_NONE16 ? BSP_NONE : node;
+}
+
+// Moves a tree over `point_count` points to 16-bit indices when every count
+// fits. Returns whether it did.
+bool compact_bsp(bsp_tree& tree, usize point_count) {
+  if (point_count > BSP_COMPACT_MAX || tree.nodes.size() > BSP_COMPACT_MAX - 1 || tree.tris.size() > BSP_COMPACT_MAX) return false;
+  tree.nodes16.resize(tree.nodes.size());
+  for (usize i = 0; i < tree.nodes.size(); i++) {
+    bsp_node& n = tree.nodes[i];
+    tree.nodes16[i] = (bsp_node16) { n.plane, (u16) n.first, (u16) n.count, narrow_link(n.front), narrow_link(n.back), n.lo, n.hi };
+  }
+  tree.tris16.resize(tree.tris.size());
+  for (usize i = 0; i < tree.tris.size(); i++) {
+    triangle& t = tree.tris[i];
+    tree.tris16[i] = (triangle16) { (u16) t.p0, (u16) t.p1, (u16) t.p2, t.color };
+  }
+  tree.nodes = std::vector<bsp_node>();
+  tree.tris = std::vector<triangle>();
+  return true;
+}
+
+bool bsp_compact(const bsp_tree& tree) {
+  return tree.nodes16.size() > 0;
+}
+
+usize bsp_node_count(const bsp_tree& tree) {
+  return bsp_compact(tree) ? tree.nodes16.size() : tree.nodes.size();
+}
+
+usize bsp_tri_count(const bsp_tree& tree) {
+  return bsp_compact(tree) ? tree.tris16.size() : tree.tris.size();
+}
+
+// Either width as a wide node or triangle; code written over both reads
+// through these.
+const bsp_node& wide_node(const bsp_node& n) {
+  return n;
+}
+
+bsp_node wide_node(const bsp_node16& n) {
+  return (bsp_node) { n.plane, n.first, n.count, widen_link(n.front), widen_link(n.back), n.lo, n.hi };
+}
+
+const triangle& wide_tri(const triangle& t) {
+  return t;
+}
+
+triangle wide_tri(const triangle16& t) {
+  return (triangle) { t.p0, t.p1, t.p2, t.color };
+}
+
+bsp_node bsp_node_at(const bsp_tree& tree, usize i) {
+  return bsp_compact(tree) ? wide_node(tree.nodes16[i]) : tree.nodes[i];
+}
+
+triangle bsp_tri_at(const bsp_tree& tree, usize i) {
+  return bsp_compact(tree) ? wide_tri(tree.tris16[i]) : tree.tris[i];
+}
+
+// A compiled scene as the renderer reads it: the final points, split vertices
+// included, and the tree's arrays. The storage is owned elsewhere, by vectors
+// after a build or by a mapped cache file. A compacted tree is seen through
+// nodes16 and tris16, with nodes and tris NULL.
+typedef struct bsp_view {
+  const vec3 *points;
+  const bsp_node *nodes;
+  const triangle *tris;
+  u32 point_count, node_count, tri_count;
+  const bsp_node16 *nodes16;
+  const triangle16 *tris16;
+} bsp_view;
+
+bsp_view view_bsp(std::vector<vec3>& points, bsp_tree& tree) {
+  if (bsp_compact(tree)) {
+    return (bsp_view) { points.data(), NULL, NULL, (u32) points.size(), (u32) tree.nodes16.size(), (u32) tree.tris16.size(), tree.nodes16.data(), tree.tris16.data() };
+  }
+  return (bsp_view) { points.data(), tree.nodes.data(), tree.tris.data(), (u32) points.size(), (u32) tree.nodes.size(), (u32) tree.tris.size(), NULL, NULL };
+}
+
+bsp_node view_node(const bsp_view& bsp, u32 i) {
+  return bsp.nodes16 ? wide_node(bsp.nodes16[i]) : bsp.nodes[i];
+}
+
+triangle view_tri(const bsp_view& bsp, u32 i) {
+  return bsp.tris16 ? wide_tri(bsp.tris16[i]) : bsp.tris[i];
+}
+
+// How good a compiled scene is, for tuning the build options against it.
+// Depth counts the root as 1, the mean is over leaves.
+typedef struct bsp_metrics {
+  u32 nodes, leaves;
+  u32 max_depth;
+  f32 mean_depth;
+  u32 triangles;
+  u32 split_vertices; // points past the ones the models brought
+  f32 amplification;  // triangles out per triangle in
+  f64 build_ms;       // filled in by whoever timed the build
+} bsp_metrics;
+
+// Children come after their parent, so one forward pass sets every depth.
+bsp_metrics measure_bsp(bsp_view& bsp, usize source_points, usize source_tris) {
+  bsp_metrics m = {};
+  m.nodes = bsp.node_count;
+  m.triangles = bsp.tri_count;
+  m.split_vertices = bsp.point_count > source_points ? bsp.point_count - source_points : 0;
+  m.amplification = source_tris ? (f32) bsp.tri_count / source_tris : 0;
+  std::vector<u32> depth(bsp.node_count);
+  u64 leaf_depths = 0;
+  for (u32 i = 0; i < bsp.node_count; i++) {
+    bsp_node n = view_node(bsp, i);
+    if (!depth[i]) depth[i] = 1;
+    if (n.front != BSP_NONE) depth[n.front] = depth[i] + 1;
+    if (n.back != BSP_NONE) depth[n.back] = depth[i] + 1;
+    if (n.front == BSP_NONE && n.back == BSP_NONE) {
+      m.leaves++;
+      leaf_depths += depth[i];
+    }
+    m.max_depth = MAX(m.max_depth, depth[i]);
+  }
+  m.mean_depth = m.leaves ? (f32) leaf_depths / m.leaves : 0;
+  return m;
+}
+
+// Planes are normalized so PLANE_EPSILON is a distance. Degenerate triangles
+// give the zero plane.
+vec4 tri_to_plane(vec3 a, vec3 b, vec3 c) {
+  vec3 C = sub3(a, b);
+  vec3 B = sub3(a, c);
+  vec3 n = cross3(C, B);
+  f32 l = hypot3(n);
+  if (l > 0) {
+    n = div3(n, l);
+  }
+  f32 d = -dot3(a, n);
+  return cons4(n.x, n.y, n.z, d);
+}
+
+bool degenerate_plane(vec4 plane) {
+  return plane.x == 0 && plane.y == 0 && plane.z == 0;
+}
+
+u8 behind_plane(vec3 point, vec4 plane) {
+  return classify_point(plane, point.x, point.y, point.z);
+}
+
+vec3 line_x_plane(vec3 start, vec3 end, vec4 plane) {
+  // start = i, end = j
+  vec3 n = to_4_3(plane);
+  f32 d = plane.w;
+  f32 p = (dot3(end, n) + d) / dot3(sub3(start, end), n);
+  return sub3(mul3(end, 1+p), mul3(start, p));
+}
+
+#define SPLIT_TAG 0x80000000u
+
+#define BSP_TASK_GRAIN 256
+#define CHOOSE_TASK_GRAIN 2048
+
+// Vertices created by splits during a build. They live in provisional slots
+// past `base` until the build finishes and they are renumbered into `ps`.
+typedef struct split_store {
+  std::vector<vec3> *ps;
+  u32 base;
+  chunk_store<vec3> slots;
+} split_store;
+
+u32 split_end(split_store& vs) {
+  return vs.base + vs.slots.next;
+}
+
+vec3 split_vertex(split_store& vs, u32 i) {
+  return i < vs.base ? (*vs.ps)[i] : chunk_at(vs.slots, i - vs.base);
+}
+
+// Moves a node's local split vertices into the store and returns the first
+// provisional index they were given.
+u32 split_commit(split_store& vs, std::vector<vec3>& local) {
+  u32 start = chunk_reserve(vs.slots, local.size());
+  for (usize i = 0; i < local.size(); i++) {
+    chunk_at(vs.slots, start + i) = local[i];
+  }
+  return start + vs.base;
+}
+
+void split_untag(polygon *polys, usize count, u32 start) {
+  for (usize i = 0; i < count; i++) {
+    polygon& poly = polys[i];
+    for (u32 k = 0; k < poly.count; k++) {
+      if (poly.p[k] & SPLIT_TAG) poly.p[k] = (poly.p[k] & ~SPLIT_TAG) + start;
+    }
+  }
+}
+
+// tri_to_plane for polygons. The normal is summed over the fan from corner 0,
+// so corners left in line by merges and cuts do not make it degenerate, and a
+// triangle gets exactly the plane tri_to_plane gives it.
+vec4 polygon_plane(split_store& vs, const polygon& poly) {
+  vec3 a = split_vertex(vs, poly.p[0]);
+  vec3 n = cons3(0, 0, 0);
+  for (u32 k = 1; k + 1 < poly.count; k++) {
+    n = add3(n, cross3(sub3(a, split_vertex(vs, poly.p[k])), sub3(a, split_vertex(vs, poly.p[k + 1]))));
+  }
+  f32 l = hypot3(n);
+  if (l > 0) {
+    n = div3(n, l);
+  }
+  f32 d = -dot3(a, n);
+  return cons4(n.x, n.y, n.z, d);
+}
+
+// Split vertices a node has made so far, by the edge they cut. Every polygon
+// in a node is cut by the same plane, so an edge is cut at the same point
+// whichever polygon reaches it first. Slots from earlier nodes are told
+// apart by their stamp instead of being cleared.
+typedef struct edge_cut {
+  u64 edge;
+  u32 index;
+  u32 stamp;
+} edge_cut;
+
+typedef struct cut_cache {
+  std::vector<edge_cut> slots;
+  u32 used;
+  u32 stamp;
+} cut_cache;
+
+void cut_cache_reset(cut_cache& cc) {
+  if (!cc.slots.size()) cc.slots.resize(64);
+  if (!++cc.stamp) {
+    for (usize i = 0; i < cc.slots.size(); i++) cc.slots[i].stamp = 0;
+    cc.stamp = 1;
+  }
+  cc.used = 0;
+}
+
+edge_cut& cut_slot(cut_cache& cc, u64 edge) {
+  usize mask = cc.slots.size() - 1;
+  usize i = (usize) ((edge * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+  while (cc.slots[i].stamp == cc.stamp && cc.slots[i].edge != edge) i = (i + 1) & mask;
+  return cc.slots[i];
+}
+
+// Tagged local index of the point where `plane` cuts edge (i, j), made on
+// first use. The point is always found from the lower index, so it does not
+// depend on which of the edge's polygons asked.
+u32 cut_vertex(cut_cache& cc, std::vector<vec3>& local, u32 i, u32 j, vec3 pi, vec3 pj, vec4 plane) {
+  if (i > j) {
+    std::swap(i, j);
+    std::swap(pi, pj);
+  }
+  u64 edge = (u64) i << 32 | j;
+  if ((cc.used + 1) * 2 > cc.slots.size()) {
+    std::vector<edge_cut> old = std::move(cc.slots);
+    cc.slots.assign(old.size() * 2, (edge_cut) {});
+    for (usize k = 0; k < old.size(); k++) {
+      if (old[k].stamp == cc.stamp) cut_slot(cc, old[k].edge) = old[k];
+    }
+  }
+  edge_cut& e = cut_slot(cc, edge);
+  if (e.stamp != cc.stamp) {
+    e = (edge_cut) { edge, SPLIT_TAG | (u32) local.size(), cc.stamp };
+    local.push_back(line_x_plane(pi, pj, plane));
+    cc.used++;
+  }
+  return e.index;
+}
+
+// How many polygons fan_polygon makes of n corners.
+u32 fan_pieces(u32 n) {
+  return n < 3 ? 0 : 1 + (n - 3) / (POLY_MAX - 2);
+}
+
+#define CUT_PIECES 3 // fan_pieces(2 * POLY_MAX), the most either side of a cut gets
+
+// Writes corners [0, n) to `out` as a polygon, or as a fan of polygons
+// sharing corner 0 when there are more than POLY_MAX, and returns how many.
+// Slivers without three corners are dropped.
+u32 fan_polygon(polygon *out, const u32 *corners, u32 n, u32 color) {
+  if (n < 3) return 0;
+  polygon poly;
+  poly.p[0] = corners[0];
+  poly.color = color;
+  u32 made = 0;
+  u32 k = 1;
+  for (; n - k + 1 > POLY_MAX; k += POLY_MAX - 2) {
+    std::copy(corners + k, corners + k + POLY_MAX - 1, poly.p + 1);
+    poly.count = POLY_MAX;
+    out[made++] = poly;
+  }
+  std::copy(corners + k, corners + n, poly.p + 1);
+  poly.count = n - k + 1;
+  out[made++] = poly;
+  return made;
+}
+
+const u8 FILED_FRONT = 0;
+const u8 FILED_BACK = 1;
+const u8 FILED_ON = 2;  // lies on the plane
+const u8 FILED_CUT = 3; // crosses the plane
+
+// Where a polygon goes, from its corners' sides. For one that crosses the
+// plane, also how many pieces cut_polygon makes on either side.
+u8 file_polygon(const u8 *side, u32 count, u32& front_pieces, u32& back_pieces) {
+  u32 fronts = 0, backs = 0, crossings = 0;
+  for (u32 k = 0; k < count; k++) {
+    fronts += side[k] == 0;
+    backs += side[k] == 1;
+    crossings += side[k] + side[(k + 1) % count] == 1;
+  }
+  front_pieces = back_pieces = 0;
+  if (!fronts && !backs) return FILED_ON;
+  if (!backs || !fronts) return backs ? FILED_BACK : FILED_FRONT;
+  front_pieces = fan_pieces(count - backs + crossings);
+  back_pieces = fan_pieces(count - fronts + crossings);
+  return FILED_CUT;
+}
+
+// Cuts a polygon that crosses the plane in two where its edges cross it, the
+// pieces keeping its winding, and returns how many each side got. New
+// vertices go to `local` until the node is committed with split_commit.
+void cut_polygon(vec4 plane, const polygon& poly, const u8 *side, split_store& vs, cut_cache& cc, std::vector<vec3>& local, polygon *front, u32& front_count, polygon *back, u32& back_count) {
+  // Corners on the plane go to both pieces. A polygon bent by rounding can
+  // cross more than twice, hence the room.
+  u32 f[2 * POLY_MAX], b[2 * POLY_MAX];
+  u32 nf = 0, nb = 0;
+  for (u32 k = 0; k < poly.count; k++) {
+    u32 j = (k + 1) % poly.count;
+    if (side[k] != 1) f[nf++] = poly.p[k];
+    if (side[k] != 0) b[nb++] = poly.p[k];
+    if (side[k] + side[j] == 1) {
+      u32 m = cut_vertex(cc, local, poly.p[k], poly.p[j], split_vertex(vs, poly.p[k]), split_vertex(vs, poly.p[j]), plane);
+      f[nf++] = m;
+      b[nb++] = m;
+    }
+  }
+  front_count = fan_polygon(front, f, nf, poly.color);
+  back_count = fan_polygon(back, b, nb, poly.color);
+}
+
+// Nodes are made concurrently during a build and laid out into a bsp_tree once
+// it finishes. Their polygons sit in the build's `placed` store: the test
+// polygon, then the ones found lying on its plane.
+typedef struct build_node {
+  vec4 plane;
+  polygon test;
+  u32 first, count;
+  u32 front, back;
+  u32 split_start, split_count; // provisional split vertices made here
+} build_node;
+
+// A node still to be processed. Its polygons are [begin, end) of `store`,
+// and it may use the store up to `limit` for the pieces its splits make.
+// Ranges never share slots, so tasks can work on one store at once, and
+// the store is never resized under them.
+typedef struct bsp_range {
+  u32 branch;
+  std::shared_ptr<std::vector<polygon>> store;
+  usize begin, end, limit;
+} bsp_range;
+
+#define BSP_SLACK 4 // a range's room is a quarter more than its polygons
+
+usize bsp_room(usize count) {
+  return count + count / BSP_SLACK + 2 * CUT_PIECES;
+}
+
+// Copies a range that has outgrown its room into a store of its own, with
+// space for `extra` more polygons and the usual slack.
+void relocate_range(bsp_range& r, usize extra) {
+  usize count = r.end - r.begin;
+  std::shared_ptr<std::vector<polygon>> store = std::make_shared<std::vector<polygon>>(bsp_room(count + extra));
+  std::copy(r.store->begin() + r.begin, r.store->begin() + r.end, store->begin());
+  r.store = store;
+  r.begin = 0;
+  r.end = count;
+  r.limit = store->size();
+}
+
+const u8 SPLITTER_BEST = 0;   // every plane against every polygon
+const u8 SPLITTER_SAMPLE = 1; // sampled planes against sampled polygons
+const u8 SPLITTER_FAST = 2;   // first sampled plane under the accept cost
+
+typedef struct bsp_options {
+  u32 splitter;
+  u32 candidates; // planes tried by SAMPLE and FAST
+  u32 scored;     // polygons each plane is rated against, 0 = all of them
+  f32 accept;     // average cost per rated polygon FAST settles for
+  u32 merge;      // merge coplanar neighbours into polygons before building
+  f32 split_weight;   // cost per triangle a cut adds
+  f32 balance_weight; // cost per polygon of difference between the sides
+} bsp_options;
+
+// Shared with whoever started a build, which may read the counts while it
+// runs. Setting `cancel` makes the build stop early and return an empty tree.
+typedef struct bsp_progress {
+  std::atomic<u64> total{0};    // polygons generate_bsp starts from
+  std::atomic<u64> polygons{0}; // polygons filed into finished nodes
+  std::atomic<u32> nodes{0};
+  std::atomic<bool> cancel{false};
+} bsp_progress;
+
+bool progress_cancelled(bsp_progress *progress) {
+  return progress && progress->cancel.load(std::memory_order_relaxed);
+}
+
+typedef struct bsp_build {
+  split_store verts;
+  chunk_store<build_node> nodes;
+  chunk_store<polygon> placed;
+  bsp_options options;
+  task_pool *pool;
+  task_group group;
+  bsp_progress *progress;
+} bsp_build;
+
+// A list of polygons laid out for classify_points: every distinct vertex once,
+// structure-of-arrays, with the corners as slots into it. Polygon k's corners
+// are corners[starts[k], starts[k + 1]). Classifying the vertices and then
+// looking up each corner's side replaces a behind_plane call per corner.
+typedef struct classify_set {
+  std::vector<u32> ids;
+  std::vector<f32> x, y, z;
+  std::vector<u32> corners;
+  std::vector<u32> starts;
+  std::vector<u8> side;
+} classify_set;
+
+// Vertex index -> slot + 1 in the set being filled, zeroed again afterwards.
+thread_local std::vector<u32> vertex_slot = {};
+
+u32 classify_slot(classify_set& cs, split_store& vs, u32 i) {
+  if (!vertex_slot[i]) {
+    vec3 p = split_vertex(vs, i);
+    cs.ids.push_back(i);
+    cs.x.push_back(p.x);
+    cs.y.push_back(p.y);
+    cs.z.push_back(p.z);
+    vertex_slot[i] = cs.ids.size();
+  }
+  return vertex_slot[i] - 1;
+}
+
+// Fills the set with polys, or with just the picked entries of polys.
+void classify_fill(classify_set& cs, split_store& vs, const polygon *polys, usize count, std::vector<u32> *pick) {
+  cs.ids.clear();
+  cs.x.clear();
+  cs.y.clear();
+  cs.z.clear();
+  cs.corners.clear();
+  cs.starts.clear();
+  if (vertex_slot.size() < split_end(vs)) {
+    vertex_slot.resize(split_end(vs) + split_end(vs) / 2);
+  }
+  if (pick) count = pick->size();
+  for (usize k = 0; k < count; k++) {
+    const polygon& poly = polys[pick ? (*pick)[k] : k];
+    cs.starts.push_back(cs.corners.size());
+    for (u32 c = 0; c < poly.count; c++) {
+      cs.corners.push_back(classify_slot(cs, vs, poly.p[c]));
+    }
+  }
+  cs.starts.push_back(cs.corners.size());
+  for (usize k = 0; k < cs.ids.size(); k++) {
+    vertex_slot[cs.ids[k]] = 0;
+  }
+  cs.side.resize(cs.ids.size());
+}
+
+void classify_set_plane(classify_set& cs, vec4 plane, u8 *side) {
+  classify_points(plane, cs.x.data(), cs.y.data(), cs.z.data(), cs.ids.size(), side);
+}
+
+// Copies polygon k's corner sides out of `side`.
+void classify_corners(classify_set& cs, u8 *side, usize k, u8 *out) {
+  for (u32 i = cs.starts[k]; i < cs.starts[k + 1]; i++) {
+    out[i - cs.starts[k]] = side[cs.corners[i]];
+  }
+}
+
+// The triangles a cut adds to a polygon's fans, given how many of its
+// corners are strictly in front, strictly behind and on the plane. The plane
+// leaves a convex polygon through two points, each a corner on it or an edge
+// it crosses, so the pieces have two triangles more than the polygon, less
+// one per corner on the plane: a cut through two corners adds none. Nothing
+// is added unless corners lie strictly on both sides.
+u32 cut_added(u32 front, u32 back, u32 on) {
+  if (!front || !back) return 0;
+  return on < 2 ? 2 - on : 0;
+}
+
+// Rates `plane` against the set, leaving out polygon `skip` of the list the
+// set was filled from: one per polygon, split_weight per triangle cuts add
+// and balance_weight per polygon of difference between the two sides. Cut
+// polygons count on both sides, ones on the plane on neither.
+f32 score_test(classify_set& cs, std::vector<u32> *pick, vec4 plane, usize skip, u8 *side, const bsp_options& o) {
+  if (degenerate_plane(plane)) {
+    // Everything is "on" a zero plane, it would swallow the whole list.
+    return FLT_MAX;
+  }
+  classify_set_plane(cs, plane, side);
+  const u32 *corners = cs.corners.data();
+  const u32 *starts = cs.starts.data();
+  usize count = cs.starts.size() - 1;
+  u32 rated = 0, added = 0, front = 0, back = 0;
+  u32 i = 0;
+  for (usize k = 0; k < count; k++) {
+    u32 sides[3] = { 0, 0, 0 };
+    for (; i < starts[k + 1]; i++) {
+      sides[side[corners[i]]]++;
+    }
+    if ((pick ? (*pick)[k] : k) != skip) {
+      rated++;
+      added += cut_added(sides[0], sides[1], sides[2]);
+      front += sides[0] > 0;
+      back += sides[1] > 0;
+    }
+  }
+  return rated + o.split_weight * added + o.balance_weight * (front > back ? front - back : back - front);
+}
+
+// `cs` holds all of polys, candidates are [from, to). Stops early, with
+// whatever it has, when the build is cancelled.
+usize choose_test(bsp_build& b, const polygon *polys, classify_set& cs, usize from, usize to, u8 *side) {
+  usize best_index = from;
+  f32 best_score = INFINITY;
+  for (usize i = from; i < to && !progress_cancelled(b.progress); i++) {
+    f32 score = score_test(cs, NULL, polygon_plane(b.verts, polys[i]), i, side, b.options);
+    if (score < best_score) {
+      best_index = i;
+      best_score = score;
+    }
+  }
+  return best_index;
+}
+
+// Seeds a node's sampling from its contents: the list size and the corners of
+// its first polygon. Corners are hashed by position, since split vertices are
+// numbered in whatever order the build's tasks made them, so a node makes the
+// same choice however the build was scheduled.
+u32 sample_seed(split_store& vs, const polygon *polys, usize count) {
+  u64 h = hash_bytes(0xcbf29ce484222325ull, &count, sizeof(count));
+  for (u32 k = 0; k < polys[0].count; k++) {
+    vec3 p = split_vertex(vs, polys[0].p[k]);
+    h = hash_bytes(h, &p, sizeof(p));
+  }
+  return (u32) (h ^ h >> 32);
+}
+
+// `count` distinct picks from [0, n), by a partial Fisher-Yates shuffle.
+void sample_indices(std::vector<u32>& out, usize count, usize n, u32 seed) {
+  u32 state = seed ? seed : 1;
+  std::vector<u32> order(n);
+  for (usize i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  for (usize k = 0; k < count; k++) {
+    std::swap(order[k], order[k + xorshift32(state) % (n - k)]);
+    out.push_back(order[k]);
+  }
+}
+
+usize choose_sampled(bsp_build& b, const polygon *polys, usize count, classify_set& cs) {
+  bsp_options& o = b.options;
+  std::vector<u32> candidates = {};
+  std::vector<u32> sample = {};
+  u32 seed = sample_seed(b.verts, polys, count);
+  if (o.candidates && count > o.candidates) {
+    sample_indices(candidates, o.candidates, count, seed ^ 0x9e3779b9);
+  } else {
+    for (usize i = 0; i < count; i++) {
+      candidates.push_back(i);
+    }
+  }
+  if (o.scored && count > o.scored) {
+    sample_indices(sample, o.scored, count, seed ^ 0x85ebca6b);
+  }
+  classify_fill(cs, b.verts, polys, count, sample.size() ? &sample : NULL);
+
+  u32 rated = sample.size() ? sample.size() : count - 1;
+  f32 acceptable = o.splitter == SPLITTER_FAST ? rated * o.accept : 0;
+  usize best_index = candidates[0];
+  f32 best_score = INFINITY;
+  for (usize k = 0; k < candidates.size(); k++) {
+    usize i = candidates[k];
+    f32 score = score_test(cs, sample.size() ? &sample : NULL, polygon_plane(b.verts, polys[i]), i, cs.side.data(), o);
+    if (score < best_score) {
+      best_index = i;
+      best_score = score;
+      if (score <= acceptable) {
+	break;
+      }
+    }
+  }
+  return best_index;
+}
+
+// Large lists score their candidates in parallel. Each chunk keeps its first
+// best candidate and chunks are reduced in order, so ties resolve the same way
+// as the serial scan.
+usize choose_test(bsp_build& b, const polygon *polys, usize count, classify_set& cs) {
+  if (b.options.splitter != SPLITTER_BEST) {
+    return choose_sampled(b, polys, count, cs);
+  }
+  classify_fill(cs, b.verts, polys, count, NULL);
+  if (!b.pool || count < CHOOSE_TASK_GRAIN) {
+    return choose_test(b, polys, cs, 0, count, cs.side.data());
+  }
+
+  usize chunks = count / (CHOOSE_TASK_GRAIN / 8);
+  std::vector<usize> best(chunks);
+  task_group group;
+  for (usize k = 0; k < chunks; k++) {
+    usize from = count * k / chunks;
+    usize to = count * (k + 1) / chunks;
+    pool_spawn(*b.pool, group, [&b, polys, &cs, &best, k, from, to] {
+      std::vector<u8> side(cs.ids.size());
+      best[k] = choose_test(b, polys, cs, from, to, side.data());
+    });
+  }
+  pool_wait(*b.pool, group);
+
+  usize best_index = best[0];
+  f32 best_score = score_test(cs, NULL, polygon_plane(b.verts, polys[best_index]), best_index, cs.side.data(), b.options);
+  for (usize k = 1; k < chunks; k++) {
+    f32 score = score_test(cs, NULL, polygon_plane(b.verts, polys[best[k]]), best[k], cs.side.data(), b.options);
+    if (score < best_score) {
+      best_index = best[k];
+      best_score = score;
+    }
+  }
+  return best_index;
+}
+
+// Takes the test polygon out of polys, moving it to the end, and makes the
+// node that splits on it.
+u32 make_branch(bsp_build& b, polygon *polys, usize count, classify_set& cs) {
+  usize test_index = choose_test(b, polys, count, cs);
+  std::swap(polys[test_index], polys[count - 1]);
+  u32 branch = chunk_reserve(b.nodes, 1);
+  build_node& node = chunk_at(b.nodes, branch);
+  node.test = polys[count - 1];
+  node.plane = polygon_plane(b.verts, node.test);
+  node.count = 0;
+  node.front = BSP_NONE;
+  node.back = BSP_NONE;
+  node.split_count = 0;
+  return branch;
+}
+
+// Scratch reused by every node a task processes, so a node costs no
+// allocations once the buffers have grown.
+typedef struct bsp_scratch {
+  std::vector<u8> filed;     // FILED_*, by the polygon's place in the range before partitioning
+  std::vector<u32> origin;   // that place, for each slot as the range is partitioned
+  std::vector<polygon> held; // front pieces waiting for a free slot
+  std::vector<vec3> local;
+  classify_set cs;
+  cut_cache cuts;
+} bsp_scratch;
+
+// Lomuto partition of [from, to) that moves the polygons filed as `which` to
+// the start and carries `origin` along. Returns where the others begin.
+usize gather(polygon *polys, u32 *origin, const u8 *filed, usize from, usize to, u8 which) {
+  usize i = from;
+  for (usize k = from; k < to; k++) {
+    if (filed[origin[k]] != which) continue;
+    std::swap(polys[i], polys[k]);
+    std::swap(origin[i], origin[k]);
+    i++;
+  }
+  return i;
+}
+
+// Moves polys[begin, end) right by k slots: the first k polygons go to the end,
+// or the whole run moves when it is no longer than k.
+void shift_run(polygon *polys, usize& begin, usize& end, usize k) {
+  if (k >= end - begin) {
+    std::copy_backward(polys + begin, polys + end, polys + end + k);
+  } else {
+    std::copy(polys + begin, polys + begin + k, polys + end);
+  }
+  begin += k;
+  end += k;
+}
+
+// Builds the subtree under `root`. Each node partitions its range in place,
+// quicksort-style, into [front | on | cut | back]. Polygons on the plane go
+// to the node, and cut pieces go where the cut polygons were: front pieces
+// into the freed middle, back pieces onto the end of the back run in the
+// range's spare room. What room is left is shared out between the two
+// children, so neither has to move far to grow. A range is copied only when
+// it outgrows its room. Children with enough polygons move out into tasks of
+// their own, handed their part of the store as it is.
+void build_subtree(bsp_build& b, bsp_range root) {
+  bsp_scratch sc = {};
+  std::vector<bsp_range> stack = { root };
+
+  while (stack.size() && !progress_cancelled(b.progress)) {
+    bsp_range r = std::move(stack.back());
+    stack.pop_back();
+    build_node& node = chunk_at(b.nodes, r.branch);
+    usize count = r.end - r.begin;
+    classify_fill(sc.cs, b.verts, r.store->data() + r.begin, count, NULL);
+    classify_set_plane(sc.cs, node.plane, sc.cs.side.data());
+
+    // Counting the pieces first finds a range without room before anything
+    // has moved.
+    usize ons = 0, cuts = 0, front_pieces = 0, back_pieces = 0;
+    sc.filed.resize(count);
+    sc.origin.resize(count);
+    for (usize i = 0; i < count; i++) {
+      u8 side[POLY_MAX];
+      u32 f, bk;
+      classify_corners(sc.cs, sc.cs.side.data(), i, side);
+      sc.filed[i] = file_polygon(side, (*r.store)[r.begin + i].count, f, bk);
+      sc.origin[i] = i;
+      ons += sc.filed[i] == FILED_ON;
+      cuts += sc.filed[i] == FILED_CUT;
+      front_pieces += f;
+      back_pieces += bk;
+    }
+    usize overflow = front_pieces > ons + cuts ? front_pieces - ons - cuts : 0;
+    if (r.end + back_pieces + overflow > r.limit) {
+      relocate_range(r, back_pieces + overflow);
+    }
+
+    polygon *polys = r.store->data() + r.begin;
+    u32 *origin = sc.origin.data();
+    usize on_begin = gather(polys, origin, sc.filed.data(), 0, count, FILED_FRONT);
+    usize cut_begin = gather(polys, origin, sc.filed.data(), on_begin, count, FILED_ON);
+    usize back_begin = gather(polys, origin, sc.filed.data(), cut_begin, count, FILED_CUT);
+
+    node.count = 1 + ons;
+    node.first = chunk_reserve(b.placed, node.count);
+    chunk_at(b.placed, node.first) = node.test;
+    for (usize i = 0; i < ons; i++) {
+      chunk_at(b.placed, node.first + 1 + i) = polys[on_begin + i];
+    }
+    if (b.progress) {
+      b.progress->polygons.fetch_add(node.count, std::memory_order_relaxed);
+      b.progress->nodes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Front pieces fill the middle from its start; one that would land on a
+    // polygon not yet cut is held back.
+    sc.local.clear();
+    sc.held.clear();
+    cut_cache_reset(sc.cuts);
+    usize front_end = on_begin;
+    usize back_end = count;
+    for (usize i = cut_begin; i < back_begin; i++) {
+      polygon poly = polys[i];
+      u8 side[POLY_MAX];
+      polygon f[CUT_PIECES], bk[CUT_PIECES];
+      u32 nf, nb;
+      classify_corners(sc.cs, sc.cs.side.data(), origin[i], side);
+      cut_polygon(node.plane, poly, side, b.verts, sc.cuts, sc.local, f, nf, bk, nb);
+      for (u32 k = 0; k < nf; k++) {
+	if (front_end <= i) {
+	  polys[front_end++] = f[k];
+	} else {
+	  sc.held.push_back(f[k]);
+	}
+      }
+      for (u32 k = 0; k < nb; k++) {
+	polys[back_end++] = bk[k];
+      }
+    }
+    if (sc.local.size()) {
+      u32 start = split_commit(b.verts, sc.local);
+      split_untag(polys + on_begin, front_end - on_begin, start);
+      split_untag(sc.held.data(), sc.held.size(), start);
+      split_untag(polys + count, back_end - count, start);
+      node.split_start = start;
+      node.split_count = sc.local.size();
+    }
+    // Once the middle is full, the back run moves up a slot per held piece.
+    for (usize i = 0; i < sc.held.size(); i++) {
+      if (front_end == back_begin) shift_run(polys, back_begin, back_end, 1);
+      polys[front_end++] = sc.held[i];
+    }
+
+    // The front run gets its share of the spare room by the back run moving
+    // up into the rest.
+    usize room = r.limit - r.begin;
+    usize used = front_end + (back_end - back_begin);
+    if (used) {
+      usize share = (room - used) * front_end / used;
+      usize has = back_begin - front_end;
+      if (share > has) shift_run(polys, back_begin, back_end, MIN(share - has, room - back_end));
+    }
+
+    bsp_range children[2] = {
+      { BSP_NONE, r.store, r.begin, r.begin + front_end, r.begin + back_begin },
+      { BSP_NONE, r.store, r.begin + back_begin, r.begin + back_end, r.limit }
+    };
+    for (u32 k = 0; k < 2; k++) {
+      bsp_range& c = children[k];
+      if (c.begin == c.end) continue;
+      c.branch = make_branch(b, r.store->data() + c.begin, c.end - c.begin, sc.cs);
+      c.end--;
+      if (k == 0) {
+	node.front = c.branch;
+      } else {
+	node.back = c.branch;
+      }
+    }
+
+    // Back on top, so a serial build visits nodes in the order finish_bsp
+    // lays them out.
+    for (u32 k = 0; k < 2; k++) {
+      bsp_range& c = children[k];
+      if (c.branch == BSP_NONE) continue;
+      if (b.pool && c.end - c.begin >= BSP_TASK_GRAIN) {
+	pool_spawn(*b.pool, b.group, [&b, c] { build_subtree(b, c); });
+      } else {
+	stack.push_back(std::move(c));
+      }
+    }
+  }
+}
+
+typedef struct layout_entry {
+  u32 node;
+  u32 parent;
+  bool front;
+} layout_entry;
+
+// Lays the build nodes out in the order a serial build visits them (node, then
+// back subtree, then front subtree) and renumbers split vertices into `ps` in
+// the order it would have created them, so the result does not depend on how
+// the work was scheduled. Polygons are fanned into triangles from corner 0.
+bsp_tree finish_bsp(bsp_build& b, u32 root) {
+  std::vector<vec3>& ps = *b.verts.ps;
+  u32 base = b.verts.base;
+  bsp_tree tree = {};
+  tree.nodes.reserve(b.nodes.next);
+  ps.reserve(split_end(b.verts));
+
+  std::vector<u32> remap(b.verts.slots.next);
+  std::vector<layout_entry> stack = { (layout_entry) { root, BSP_NONE, false } };
+  while (stack.size()) {
+    layout_entry e = stack.back();
+    stack.pop_back();
+    build_node& n = chunk_at(b.nodes, e.node);
+    u32 index = tree.nodes.size();
+    if (e.parent != BSP_NONE) {
+      if (e.front) {
+	tree.nodes[e.parent].front = index;
+      } else {
+	tree.nodes[e.parent].back = index;
+      }
+    }
+
+    for (u32 k = 0; k < n.split_count; k++) {
+      remap[n.split_start - base + k] = ps.size();
+      ps.push_back(split_vertex(b.verts, n.split_start + k));
+    }
+    // Split vertices are made by ancestors, which are already laid out.
+    u32 first = tree.tris.size();
+    vec3 lo = cons3(INFINITY, INFINITY, INFINITY);
+    vec3 hi = cons3(-INFINITY, -INFINITY, -INFINITY);
+    for (u32 j = 0; j < n.count; j++) {
+      polygon poly = chunk_at(b.placed, n.first + j);
+      for (u32 k = 0; k < poly.count; k++) {
+	if (poly.p[k] >= base) poly.p[k] = remap[poly.p[k] - base];
+	vec3 p = ps[poly.p[k]];
+	lo = cons3(MIN(lo.x, p.x), MIN(lo.y, p.y), MIN(lo.z, p.z));
+	hi = cons3(MAX(hi.x, p.x), MAX(hi.y, p.y), MAX(hi.z, p.z));
+      }
+      for (u32 k = 1; k + 1 < poly.count; k++) {
+	tree.tris.push_back((triangle) { poly.p[0], poly.p[k], poly.p[k + 1], poly.color });
+      }
+    }
+    tree.nodes.push_back((bsp_node) { n.plane, first, (u32) tree.tris.size() - first, BSP_NONE, BSP_NONE, lo, hi });
+
+    if (n.front != BSP_NONE) stack.push_back((layout_entry) { n.front, index, true });
+    if (n.back != BSP_NONE) stack.push_back((layout_entry) { n.back, index, false });
+  }
+
+  chunk_free(b.nodes);
+  chunk_free(b.placed);
+  chunk_free(b.verts.slots);
+  return tree;
+}
+
+// Widens each node's bounds, which finish_bsp set to its own triangles', by
+// its children's. Children come after their parent, so one backwards pass
+// sees every child's bounds before the parent's.
+void bound_bsp(bsp_tree& tree) {
+  for (usize i = tree.nodes.size(); i-- > 0;) {
+    bsp_node& n = tree.nodes[i];
+    u32 children[2] = { n.front, n.back };
+    for (u32 k = 0; k < 2; k++) {
+      if (children[k] == BSP_NONE) continue;
+      bsp_node& c = tree.nodes[children[k]];
+      n.lo = cons3(MIN(n.lo.x, c.lo.x), MIN(n.lo.y, c.lo.y), MIN(n.lo.z, c.lo.z));
+      n.hi = cons3(MAX(n.hi.x, c.hi.x), MAX(n.hi.y, c.hi.y), MAX(n.hi.z, c.hi.z));
+    }
+  }
+}
+
+// A triangle's directed edge, p0 -> p1 and so on round it.
+typedef struct edge_owner {
+  u64 edge;
+  u32 tri;
+} edge_owner;
+
+// True unless the corner at b turns against `n`. Corners in line pass.
+bool convex_corner(vec3 a, vec3 b, vec3 c, vec3 n) {
+  vec3 u = sub3(b, a);
+  vec3 v = sub3(c, b);
+  return dot3(cross3(u, v), n) >= -1e-6f * hypot3(u) * hypot3(v);
+}
+
+// The triangle across edge a -> b of a polygon that can take it: unused, the
+// same colour, facing the same way and with its third corner on `plane`.
+// Returns that corner, or BSP_NONE.
+u32 merge_neighbour(std::vector<vec3>& ps, const std::vector<triangle>& tris, std::vector<edge_owner>& edges, std::vector<bool>& used, u32 a, u32 b, vec4 plane, u32 color, u32& tri) {
+  u64 edge = (u64) b << 32 | a;
+  auto it = std::lower_bound(edges.begin(), edges.end(), edge, [](const edge_owner& e, u64 key) { return e.edge < key; });
+  for (; it != edges.end() && it->edge == edge; it++) {
+    const triangle& t = tris[it->tri];
+    if (used[it->tri] || t.color != color) continue;
+    u32 c = t.p0 == a ? t.p1 : t.p1 == a ? t.p2 : t.p0;
+    vec4 own = tri_to_plane(ps[t.p0], ps[t.p1], ps[t.p2]);
+    if (degenerate_plane(own) || dot3(to_4_3(own), to_4_3(plane)) <= 0 || behind_plane(ps[c], plane) != 2) continue;
+    tri = it->tri;
+    return c;
+  }
+  return BSP_NONE;
+}
+
+// Grows convex polygons of up to POLY_MAX corners out of `tris`. A triangle
+// joins the polygon it shares an edge with when it has the same colour, lies
+// in the plane of the triangle the polygon started from and keeps it convex.
+// Corners are never dropped, so no neighbour is left with a T-junction.
+// Polygons start from triangles in order, so the result depends only on the
+// input.
+std::vector<polygon> merge_coplanar(std::vector<vec3>& ps, const std::vector<triangle>& tris) {
+  std::vector<edge_owner> edges;
+  edges.reserve(tris.size() * 3);
+  for (u32 i = 0; i < tris.size(); i++) {
+    const triangle& t = tris[i];
+    edges.push_back((edge_owner) { (u64) t.p0 << 32 | t.p1, i });
+    edges.push_back((edge_owner) { (u64) t.p1 << 32 | t.p2, i });
+    edges.push_back((edge_owner) { (u64) t.p2 << 32 | t.p0, i });
+  }
+  std::sort(edges.begin(), edges.end(), [](const edge_owner& a, const edge_owner& b) {
+    return a.edge < b.edge || (a.edge == b.edge && a.tri < b.tri);
+  });
+
+  std::vector<bool> used(tris.size());
+  std::vector<polygon> polys;
+  polys.reserve(tris.size());
+  for (u32 i = 0; i < tris.size(); i++) {
+    if (used[i]) continue;
+    used[i] = true;
+    const triangle& t = tris[i];
+    polygon poly = (polygon) { { t.p0, t.p1, t.p2 }, 3, t.color };
+    vec4 plane = tri_to_plane(ps[t.p0], ps[t.p1], ps[t.p2]);
+    vec3 n = to_4_3(plane);
+    for (u32 k = 0; !degenerate_plane(plane) && k < poly.count && poly.count < POLY_MAX; k++) {
+      u32 a = poly.p[k];
+      u32 b = poly.p[(k + 1) % poly.count];
+      u32 tri;
+      u32 c = merge_neighbour(ps, tris, edges, used, a, b, plane, poly.color, tri);
+      if (c == BSP_NONE || std::find(poly.p, poly.p + poly.count, c) != poly.p + poly.count) continue;
+      vec3 before = ps[poly.p[(k + poly.count - 1) % poly.count]];
+      vec3 after = ps[poly.p[(k + 2) % poly.count]];
+      if (!convex_corner(before, ps[a], ps[c], n) || !convex_corner(ps[c], ps[b], after, n)) continue;
+      std::copy_backward(poly.p + k + 1, poly.p + poly.count, poly.p + poly.count + 1);
+      poly.p[k + 1] = c;
+      poly.count++;
+      used[tri] = true;
+    }
+    polys.push_back(poly);
+  }
+  return polys;
+}
+
+// With a pool the subtrees are built in parallel, the output is identical to
+// the serial build either way. The build works on polygons, merged from
+// coplanar neighbours when options.merge is set, and lays out triangles.
+// `progress` may be NULL. A cancelled build leaves `ps` as it was and returns
+// an empty tree.
+bsp_tree generate_bsp(std::vector<vec3>& ps, const std::vector<triangle>& tris, bsp_options options, task_pool *pool, bsp_progress *progress) {
+  if (!tris.size()) {
+    return (bsp_tree) {};
+  }
+  std::vector<polygon> polys = {};
+  if (options.merge) {
+    polys = merge_coplanar(ps, tris);
+  } else {
+    polys.reserve(tris.size());
+    for (usize i = 0; i < tris.size(); i++) {
+      const triangle& t = tris[i];
+      polys.push_back((polygon) { { t.p0, t.p1, t.p2 }, 3, t.color });
+    }
+  }
+  if (progress) progress->total.fetch_add(polys.size(), std::memory_order_relaxed);
+
+  bsp_build *b = new bsp_build();
+  b->verts.ps = &ps;
+  b->verts.base = (u32) ps.size();
+  b->options = options;
+  b->pool = pool;
+  b->progress = progress;
+
+  classify_set cs = {};
+  bsp_range root = {};
+  root.branch = make_branch(*b, polys.data(), polys.size(), cs);
+  root.end = polys.size() - 1;
+  polys.resize(bsp_room(root.end));
+  root.store = std::make_shared<std::vector<polygon>>(std::move(polys));
+  root.limit = root.store->size();
+  if (pool) {
+    pool_spawn(*pool, b->group, [b, root] { build_subtree(*b, root); });
+    pool_wait(*pool, b->group);
+  } else {
+    build_subtree(*b, root);
+  }
+
+  if (progress_cancelled(progress)) {
+    chunk_free(b->nodes);
+    chunk_free(b->placed);
+    chunk_free(b->verts.slots);
+    delete b;
+    return (bsp_tree) {};
+  }
+  bsp_tree tree = finish_bsp(*b, root.branch);
+  delete b;
+  bound_bsp(tree);
+  return tree;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "utilities.hpp"
+#include "tasks.hpp"
+#include "bsp.hpp"
+#include "scene.hpp"
+#include "cache.hpp"
+#include "viewer.hpp"
+
+// Assembles the scene off the editor thread. The job builds from copies of
+// the models, which share their meshes and local trees with the editor's,
+// and holds the editor's scene_tree while it runs, so the editor goes on
+// editing; finish_scene_job hands everything back once `done` is set.
+typedef struct scene_job {
+  std::vector<model> models;
+  std::vector<bool> fresh; // models this job was meant to (re)build
+  scene_tree world;
+  bsp_options options;
+  task_pool *pool;
+  bool use_cache; // load the scene from the cache if it matches, save it if not
+  std::string cache_path;
+  bsp_progress progress;
+  std::shared_ptr<frame_scene> result; // NULL when cancelled
+  bool from_cache;
+  bsp_metrics metrics; // of result, build_ms includes loading or saving the cache
+  std::atomic<bool> done{false};
+  std::thread thread;
+} scene_job;
+
+bool same_geometry(model& a, model& b) {
+  if (a.mesh == b.mesh) return true;
+  model_mesh& x = *a.mesh;
+  model_mesh& y = *b.mesh;
+  return x.points.size() == y.points.size() && x.tris.size() == y.tris.size()
+    && !memcmp(x.points.data(), y.points.data(), x.points.size() * sizeof(vec3))
+    && !memcmp(x.tris.data(), y.tris.data(), x.tris.size() * sizeof(triangle));
+}
+
+void run_scene_job(scene_job& job) {
+  auto start = std::chrono::steady_clock::now();
+  u64 key = job.use_cache ? scene_key(job.models, job.options) : 0;
+  std::shared_ptr<frame_scene> loaded = new_frame_scene();
+  if (job.use_cache && load_bsp_cache(job.cache_path.c_str(), key, loaded->file, loaded->view)) {
+    load_cached_trees(loaded->file, job.models, job.world, job.options);
+    job.result = loaded;
+    job.from_cache = true;
+  } else if (assemble_scene(job.world, job.models, job.options, job.pool, &job.progress)) {
+    job.result = copy_scene(job.world);
+    if (job.use_cache) {
+      // The snapshot may be compacted, the file holds the wide tree.
+      bsp_view wide = view_bsp(job.world.points, job.world.tree);
+      save_bsp_cache(job.cache_path.c_str(), key, wide, job.models, job.world);
+    }
+  }
+  if (job.result) {
+    usize points = 0, tris = 0;
+    for (usize i = 0; i < job.models.size(); i++) {
+      points += job.models[i].mesh->points.size();
+      tris += job.models[i].mesh->tris.size();
+    }
+    job.metrics = measure_bsp(job.result->view, points, tris);
+    job.metrics.build_ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+  job.done.store(true, std::memory_order_release);
+}
+
+// Takes `world` until the job is finished.
+std::unique_ptr<scene_job> start_scene_job(std::vector<model>& models, scene_tree& world, bsp_options options, task_pool *pool, bool use_cache, std::string cache_path) {
+  std::unique_ptr<scene_job> job(new scene_job());
+  bool same_options = !memcmp(&world.options, &options, sizeof(bsp_options));
+  job->models = models;
+  for (usize i = 0; i < models.size(); i++) {
+    job->fresh.push_back(!models[i].built || !same_options);
+  }
+  job->world = std::move(world);
+  world = (scene_tree) {};
+  job->options = options;
+  job->pool = pool;
+  job->use_cache = use_cache;
+  job->cache_path = cache_path;
+  job->from_cache = false;
+  job->thread = std::thread(run_scene_job, std::ref(*job));
+  return job;
+}
+
+// Joins the job and gives `world` back. Trees the job built go to the models
+// whose geometry still matches; the other models it was meant to build are
+// left to be built again.
+void finish_scene_job(scene_job& job, std::vector<model>& models, scene_tree& world) {
+  job.thread.join();
+  world = std::move(job.world);
+  for (usize i = 0; i < models.size() && i < job.models.size(); i++) {
+    model& m = models[i];
+    model& built = job.models[i];
+    if (!job.fresh[i]) continue;
+    if (built.built && same_geometry(m, built)) {
+      m.local = std::move(built.local);
+      m.built = true;
+    } else {
+      m.built = false;
+    }
+  }
+}
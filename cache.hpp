@@ -0,0 +1,234 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "utilities.hpp"
+#include "bsp.hpp"
+#include "scene.hpp"
+#include "mapped.hpp"
+
+// A compiled scene on disk: a header, then the points, nodes and triangles
+// exactly as they sit in memory, each array 16-byte aligned. Loading maps the
+// file and points a bsp_view into it, nothing is copied or rebuilt. The trees
+// the scene was placed from follow, so that moving a model after a load only
+// places it again: a record for each, then its arrays laid out the same way.
+
+#define BSP_CACHE_MAGIC 0x43505342u // "BSPC"
+#define BSP_CACHE_VERSION 5
+#define BSP_CACHE_ALIGN 16
+
+typedef struct bsp_cache_header {
+  u32 magic;
+  u32 version;
+  u64 key;
+  u32 point_count, node_count, tri_count;
+  u32 tree_count;
+} bsp_cache_header;
+
+// A model's local tree or a cluster's. Nodes and triangles are stored wide
+// even when the tree was kept compacted.
+typedef struct bsp_cache_tree {
+  u64 key;     // the cluster's, 0 for a model
+  u32 model;   // BSP_NONE for a cluster
+  u32 point_count, node_count, tri_count;
+  vec3 lo, hi; // the model's bounds
+} bsp_cache_tree;
+
+typedef struct bsp_cache_layout {
+  usize points, nodes, tris, end;
+} bsp_cache_layout;
+
+usize cache_align(usize at) {
+  return (at + BSP_CACHE_ALIGN - 1) & ~(usize) (BSP_CACHE_ALIGN - 1);
+}
+
+// Arrays starting from `at`.
+bsp_cache_layout cache_layout(usize at, u32 point_count, u32 node_count, u32 tri_count) {
+  bsp_cache_layout l;
+  l.points = cache_align(at);
+  l.nodes = cache_align(l.points + (usize) point_count * sizeof(vec3));
+  l.tris = cache_align(l.nodes + (usize) node_count * sizeof(bsp_node));
+  l.end = l.tris + (usize) tri_count * sizeof(triangle);
+  return l;
+}
+
+// Everything assemble_scene reads: the model geometry, the transforms and the
+// build options.
+u64 scene_key(std::vector<model>& models, bsp_options options) {
+  u64 h = 0xcbf29ce484222325ull;
+  u32 version = BSP_CACHE_VERSION;
+  h = hash_bytes(h, &version, sizeof(version));
+  h = hash_bytes(h, &options, sizeof(options));
+  for (usize i = 0; i < models.size(); i++) {
+    h = model_key(h, models[i]);
+  }
+  return h;
+}
+
+bool write_padded(FILE *f, const void *data, usize size, usize at, usize next) {
+  static const char zero[BSP_CACHE_ALIGN] = {};
+  if (size && fwrite(data, 1, size, f) != size) return false;
+  return at + size == next || fwrite(zero, 1, next - at - size, f) == next - at - size;
+}
+
+// Writes a wide view's arrays as laid out by `l`, padded up to the next
+// section.
+bool write_view(FILE *f, bsp_view& v, bsp_cache_layout l) {
+  return write_padded(f, v.points, (usize) v.point_count * sizeof(vec3), l.points, l.nodes)
+    && write_padded(f, v.nodes, (usize) v.node_count * sizeof(bsp_node), l.nodes, l.tris)
+    && write_padded(f, v.tris, (usize) v.tri_count * sizeof(triangle), l.tris, cache_align(l.end));
+}
+
+// One stored tree, widened out of its 16-bit form when it has one.
+typedef struct cache_tree {
+  bsp_cache_tree head;
+  bsp_tree wide;
+  bsp_view view;
+} cache_tree;
+
+void cache_tree_from(cache_tree& t, u64 key, u32 model, const std::vector<vec3>& points, const bsp_tree& tree, vec3 lo, vec3 hi) {
+  t.wide.nodes.resize(bsp_node_count(tree));
+  for (usize i = 0; i < t.wide.nodes.size(); i++) {
+    t.wide.nodes[i] = bsp_node_at(tree, i);
+  }
+  t.wide.tris.resize(bsp_tri_count(tree));
+  for (usize i = 0; i < t.wide.tris.size(); i++) {
+    t.wide.tris[i] = bsp_tri_at(tree, i);
+  }
+  t.view = (bsp_view) { points.data(), t.wide.nodes.data(), t.wide.tris.data(), (u32) points.size(), (u32) t.wide.nodes.size(), (u32) t.wide.tris.size(), NULL, NULL };
+  t.head = (bsp_cache_tree) { key, model, t.view.point_count, t.view.node_count, t.view.tri_count, lo, hi };
+}
+
+// Writes next to `path` and renames over it, so a reader never maps a
+// half-written file. Stores the built models' local trees and the clusters
+// of `world` along with the scene, which must not be compacted.
+bool save_bsp_cache(const char *path, u64 key, bsp_view& bsp, std::vector<model>& models, scene_tree& world) {
+  std::vector<cache_tree> trees(models.size() + world.clusters.size());
+  usize count = 0;
+  for (usize i = 0; i < models.size(); i++) {
+    model& m = models[i];
+    if (m.built) cache_tree_from(trees[count++], 0, i, m.local->points, m.local->tree, m.local->lo, m.local->hi);
+  }
+  for (usize i = 0; i < world.clusters.size(); i++) {
+    scene_cluster& c = world.clusters[i];
+    cache_tree_from(trees[count++], c.key, BSP_NONE, c.points, c.tree, cons3(0, 0, 0), cons3(0, 0, 0));
+  }
+  trees.resize(count);
+
+  bsp_cache_header h = (bsp_cache_header) { BSP_CACHE_MAGIC, BSP_CACHE_VERSION, key, bsp.point_count, bsp.node_count, bsp.tri_count, (u32) count };
+  bsp_cache_layout l = cache_layout(sizeof(h), bsp.point_count, bsp.node_count, bsp.tri_count);
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) return false;
+  usize records = cache_align(l.end);
+  usize at = cache_align(records + count * sizeof(bsp_cache_tree));
+  bool ok = write_padded(f, &h, sizeof(h), 0, l.points) && write_view(f, bsp, l);
+  for (usize i = 0; i < count && ok; i++) {
+    ok = write_padded(f, &trees[i].head, sizeof(bsp_cache_tree), records + i * sizeof(bsp_cache_tree), i + 1 < count ? records + (i + 1) * sizeof(bsp_cache_tree) : at);
+  }
+  for (usize i = 0; i < count && ok; i++) {
+    bsp_view& v = trees[i].view;
+    bsp_cache_layout tl = cache_layout(at, v.point_count, v.node_count, v.tri_count);
+    ok = write_view(f, v, tl);
+    at = cache_align(tl.end);
+  }
+  ok = !fclose(f) && ok;
+  if (ok) {
+    remove(path);
+    ok = !rename(tmp.c_str(), path);
+  }
+  if (!ok) remove(tmp.c_str());
+  return ok;
+}
+// Children always come after their parent, so a tree that passes cannot send
+// a traversal around in a loop.
+bool check_bsp(bsp_view& bsp) {
+  for (u32 i = 0; i < bsp.node_count; i++) {
+    bsp_node n = view_node(bsp, i);
+    if ((u64) n.first + n.count > bsp.tri_count) return false;
+    if (n.front != BSP_NONE && (n.front <= i || n.front >= bsp.node_count)) return false;
+    if (n.back != BSP_NONE && (n.back <= i || n.back >= bsp.node_count)) return false;
+  }
+  for (u32 i = 0; i < bsp.tri_count; i++) {
+    triangle t = view_tri(bsp, i);
+    if (t.p0 >= bsp.point_count || t.p1 >= bsp.point_count || t.p2 >= bsp.point_count) return false;
+  }
+  return true;
+}
+
+bsp_view cache_view(mapped_file& file, bsp_cache_layout l, u32 point_count, u32 node_count, u32 tri_count) {
+  return (bsp_view) { (const vec3 *) (file.data + l.points), (const bsp_node *) (file.data + l.nodes), (const triangle *) (file.data + l.tris), point_count, node_count, tri_count, NULL, NULL };
+}
+
+// The trees stored after the scene, with views into `file`. False when they
+// do not fill the rest of the file exactly or one is damaged.
+bool cached_trees(mapped_file& file, bsp_cache_header& h, std::vector<bsp_cache_tree>& heads, std::vector<bsp_view>& views) {
+  usize records = cache_align(cache_layout(sizeof(h), h.point_count, h.node_count, h.tri_count).end);
+  usize at = cache_align(records + (usize) h.tree_count * sizeof(bsp_cache_tree));
+  if (at > file.size) return false;
+  heads.resize(h.tree_count);
+  views.resize(h.tree_count);
+  for (u32 i = 0; i < h.tree_count; i++) {
+    memcpy(&heads[i], file.data + records + i * sizeof(bsp_cache_tree), sizeof(bsp_cache_tree));
+    bsp_cache_layout l = cache_layout(at, heads[i].point_count, heads[i].node_count, heads[i].tri_count);
+    if (l.end > file.size) return false;
+    views[i] = cache_view(file, l, heads[i].point_count, heads[i].node_count, heads[i].tri_count);
+    if (!check_bsp(views[i])) return false;
+    at = cache_align(l.end);
+  }
+  return at == file.size;
+}
+
+// Maps `path` into `file` and points `bsp` at it. Fails, leaving nothing
+// mapped, when the file is missing, damaged or was built from other input.
+bool load_bsp_cache(const char *path, u64 key, mapped_file& file, bsp_view& bsp) {
+  if (!map_file(path, file)) return false;
+  bsp_cache_header h;
+  bool ok = file.size >= sizeof(h);
+  if (ok) {
+    memcpy(&h, file.data, sizeof(h));
+    ok = h.magic == BSP_CACHE_MAGIC && h.version == BSP_CACHE_VERSION && h.key == key
+      && cache_layout(sizeof(h), h.point_count, h.node_count, h.tri_count).end <= file.size;
+  }
+  std::vector<bsp_cache_tree> heads;
+  std::vector<bsp_view> views;
+  if (ok) {
+    bsp = cache_view(file, cache_layout(sizeof(h), h.point_count, h.node_count, h.tri_count), h.point_count, h.node_count, h.tri_count);
+    ok = check_bsp(bsp) && cached_trees(file, h, heads, views);
+  }
+  if (!ok) {
+    unmap_file(file);
+    bsp = (bsp_view) {};
+  }
+  return ok;
+}
+
+// Copies the trees stored with a scene load_bsp_cache accepted back into the
+// models, marking them built, and into `world`'s clusters. `world` takes the
+// options the scene was built with, so the next assemble_scene reuses them.
+void load_cached_trees(mapped_file& file, std::vector<model>& models, scene_tree& world, bsp_options options) {
+  bsp_cache_header h;
+  memcpy(&h, file.data, sizeof(h));
+  std::vector<bsp_cache_tree> heads;
+  std::vector<bsp_view> views;
+  cached_trees(file, h, heads, views);
+  world.clusters.clear();
+  world.options = options;
+  for (usize i = 0; i < heads.size(); i++) {
+    bsp_view& v = views[i];
+    std::vector<vec3> points(v.points, v.points + v.point_count);
+    bsp_tree tree = {};
+    tree.nodes.assign(v.nodes, v.nodes + v.node_count);
+    tree.tris.assign(v.tris, v.tris + v.tri_count);
+    if (heads[i].model == BSP_NONE) {
+      world.clusters.push_back((scene_cluster) { heads[i].key, std::move(points), std::move(tree) });
+    } else if (heads[i].model < models.size()) {
+      std::shared_ptr<model_tree> t = std::make_shared<model_tree>((model_tree) { std::move(points), std::move(tree), heads[i].lo, heads[i].hi });
+      compact_bsp(t->tree, t->points.size());
+      models[heads[i].model].local = t;
+      models[heads[i].model].built = true;
+    }
+  }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "utilities.hpp"
+
+#define PLANE_EPSILON 1e-4f
+
+// Every side must be rounded the same whatever the build flags, or a vertex
+// could land on different sides in different places and builds would differ
+// between compilers. On FMA targets GCC fuses multiply-adds, intrinsics
+// included, unless told not to.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+#if defined(__SSE2__)
+// Four points, summed in the same order as dot4.
+void classify4(vec4 plane, const f32 *x, const f32 *y, const f32 *z, u8 *side) {
+  __m128 eps4 = _mm_set1_ps(PLANE_EPSILON);
+  __m128 abs4 = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), _mm_loadu_ps(x)), _mm_mul_ps(_mm_set1_ps(plane.y), _mm_loadu_ps(y))), _mm_mul_ps(_mm_set1_ps(plane.z), _mm_loadu_ps(z))), _mm_set1_ps(plane.w));
+  u32 neg = _mm_movemask_ps(d);
+  u32 on = _mm_movemask_ps(_mm_cmplt_ps(_mm_and_ps(d, abs4), eps4));
+  for (u32 k = 0; k < 4; k++) {
+    side[k] = (((on >> k) & 1) << 1) | ((neg & ~on) >> k & 1);
+  }
+}
+#endif
+
+// Writes 0 (in front), 1 (behind) or 2 (within PLANE_EPSILON) for one point.
+// With SSE2 it takes a lane of classify4, like classify_points' tail.
+u8 classify_point(vec4 plane, f32 x, f32 y, f32 z) {
+#if defined(__SSE2__)
+  f32 px[4] = { x, 0, 0, 0 };
+  f32 py[4] = { y, 0, 0, 0 };
+  f32 pz[4] = { z, 0, 0, 0 };
+  u8 side[4];
+  classify4(plane, px, py, pz, side);
+  return side[0];
+#else
+  f32 d = plane.x * x + plane.y * y + plane.z * z + plane.w;
+  return fabs(d) < PLANE_EPSILON ? 2 : std::signbit(d);
+#endif
+}
+
+// classify_point for each of `count` points given as separate x, y and z
+// arrays. The vector kernels sum in the same order, and the tail goes
+// through classify4 padded, so every point agrees with classify_point.
+void classify_points(vec4 plane, const f32 *x, const f32 *y, const f32 *z, usize count, u8 *side) {
+  usize i = 0;
+#if defined(__AVX2__)
+  __m256 px8 = _mm256_set1_ps(plane.x);
+  __m256 py8 = _mm256_set1_ps(plane.y);
+  __m256 pz8 = _mm256_set1_ps(plane.z);
+  __m256 pw8 = _mm256_set1_ps(plane.w);
+  __m256 eps8 = _mm256_set1_ps(PLANE_EPSILON);
+  __m256 abs8 = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  for (; i + 8 <= count; i += 8) {
+    __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px8, _mm256_loadu_ps(x + i)), _mm256_mul_ps(py8, _mm256_loadu_ps(y + i))), _mm256_mul_ps(pz8, _mm256_loadu_ps(z + i))), pw8);
+    u32 neg = _mm256_movemask_ps(d);
+    u32 on = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_and_ps(d, abs8), eps8, _CMP_LT_OQ));
+    for (u32 k = 0; k < 8; k++) {
+      side[i + k] = (((on >> k) & 1) << 1) | ((neg & ~on) >> k & 1);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 4 <= count; i += 4) {
+    classify4(plane, x + i, y + i, z + i, side + i);
+  }
+  if (i < count) {
+    f32 px[4] = {}, py[4] = {}, pz[4] = {};
+    u8 ps[4];
+    for (usize k = 0; i + k < count; k++) {
+      px[k] = x[i + k];
+      py[k] = y[i + k];
+      pz[k] = z[i + k];
+    }
+    classify4(plane, px, py, pz, ps);
+    for (; i < count; i++) {
+      side[i] = ps[i & 3];
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    side[i] = classify_point(plane, x[i], y[i], z[i]);
+  }
+}
+
+#if !defined(__clang__) && defined(__GNUC__)
+#pragma GCC pop_options
+#endif
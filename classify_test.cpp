@@ -0,0 +1,59 @@
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+#include "utilities.hpp"
+#include "bsp.hpp"
+
+// Checks that classify_points puts every point on the same side as
+// behind_plane, in vector lanes and in the tail alike. The points sit within
+// a few PLANE_EPSILON of random planes, where rounding decides the side.
+// Prints the first disagreement and exits non-zero.
+
+f32 random_between(u32& state, f32 lo, f32 hi) {
+  return lo + (hi - lo) * (xorshift32(state) >> 8) / (f32) (1 << 24);
+}
+
+int main() {
+  u32 state = 0x6d2b79f5;
+  u32 checked = 0;
+  std::vector<f32> x, y, z;
+  std::vector<vec3> points;
+  std::vector<u8> side;
+  for (u32 run = 0; run < 50000; run++) {
+    vec3 n = cons3(random_between(state, -1, 1), random_between(state, -1, 1), random_between(state, -1, 1));
+    if (hypot3(n) < 0.1f) continue;
+    n = div3(n, hypot3(n));
+    vec3 origin = cons3(random_between(state, -50, 50), random_between(state, -50, 50), random_between(state, -50, 50));
+    vec4 plane = cons4(n.x, n.y, n.z, -dot3(origin, n));
+    // Every length up to 35 leaves a different tail after the vector loops.
+    u32 count = 1 + run % 35;
+    x.clear();
+    y.clear();
+    z.clear();
+    points.clear();
+    for (u32 k = 0; k < count; k++) {
+      vec3 along = cons3(random_between(state, -20, 20), random_between(state, -20, 20), random_between(state, -20, 20));
+      along = sub3(along, mul3(n, dot3(along, n)));
+      f32 off = random_between(state, -3, 3) * PLANE_EPSILON;
+      vec3 p = add3(add3(origin, along), mul3(n, off));
+      x.push_back(p.x);
+      y.push_back(p.y);
+      z.push_back(p.z);
+      points.push_back(p);
+    }
+    side.resize(count);
+    classify_points(plane, x.data(), y.data(), z.data(), count, side.data());
+    for (u32 k = 0; k < count; k++) {
+      u8 expected = behind_plane(points[k], plane);
+      if (side[k] != expected) {
+	printf("point %u of %u: classify_points gave %u, behind_plane %u\n", k, count, side[k], expected);
+	debug4(plane);
+	printf("%.9g %.9g %.9g\n", points[k].x, points[k].y, points[k].z);
+	return 1;
+      }
+      checked++;
+    }
+  }
+  printf("classify_points: %u points ok\n", checked);
+  return 0;
+}
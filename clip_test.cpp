@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <SDL.h>
+#include "utilities.hpp"
+#include "render.hpp"
+
+// Checks clip_to_near on triangles that cross the near plane every way they
+// can: each corner it makes must sit on the plane and on the edge it cut.
+// Prints the first failure and exits non-zero.
+
+f32 random_between(u32& state, f32 lo, f32 hi) {
+  return lo + (hi - lo) * (xorshift32(state) >> 8) / (f32) (1 << 24);
+}
+
+// True when `p` lies on segment a-b, to within rounding.
+bool on_segment(vec4 p, vec4 a, vec4 b) {
+  f32 t = (p.w - a.w) / (b.w - a.w);
+  if (t < 0 || t > 1) return false;
+  vec4 q = add4(a, mul4(sub4(b, a), t));
+  f32 scale = MAX(hypot4(a), hypot4(b));
+  return hypot4(sub4(p, q)) <= 1e-5f * scale;
+}
+
+bool check(const vec4 *in) {
+  vec4 out[4];
+  u32 n = clip_to_near(in, out);
+  u32 inside = 0;
+  for (u32 k = 0; k < 3; k++) {
+    inside += in[k].w >= NEAR_W;
+  }
+  u32 expected = inside == 0 ? 0 : inside == 3 ? 3 : inside + 2;
+  if (n != expected) {
+    printf("%u corners in front gave %u corners, expected %u\n", inside, n, expected);
+    return false;
+  }
+  for (u32 i = 0; i < n; i++) {
+    bool kept = false;
+    for (u32 k = 0; k < 3; k++) {
+      kept |= !memcmp(&out[i], &in[k], sizeof(vec4));
+    }
+    if (kept) continue;
+    if (out[i].w != NEAR_W) {
+      printf("corner %u has w = %.9g, expected %.9g\n", i, out[i].w, NEAR_W);
+      return false;
+    }
+    bool cut = false;
+    for (u32 k = 0; k < 3; k++) {
+      vec4 a = in[k];
+      vec4 b = in[(k + 1) % 3];
+      cut |= (a.w >= NEAR_W) != (b.w >= NEAR_W) && on_segment(out[i], a, b);
+    }
+    if (!cut) {
+      printf("corner %u is not on an edge that crosses the near plane\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  u32 state = 0x2545f491;
+  u32 runs = 0;
+  for (u32 i = 0; i < 100000; i++) {
+    vec4 in[3];
+    for (u32 k = 0; k < 3; k++) {
+      f32 w = random_between(state, -2, 2);
+      in[k] = cons4(random_between(state, -4, 4), random_between(state, -4, 4), random_between(state, -4, 4), w);
+    }
+    if (!check(in)) {
+      debug4(in[0]); debug4(in[1]); debug4(in[2]);
+      printf("\n");
+      return 1;
+    }
+    runs++;
+  }
+
+  // A floor edge running from behind the camera to well in front of it.
+  vec4 floor[3] = { cons4(-1, -1, 0, -0.5), cons4(1, -1, 0, 0.5), cons4(0, -1, 0, 1) };
+  vec4 out[4];
+  if (clip_to_near(floor, out) != 4 || out[0].w != NEAR_W || out[3].w != NEAR_W) {
+    printf("floor edge clipped to the wrong side\n");
+    return 1;
+  }
+  printf("clip_to_near: %u triangles ok\n", runs + 1);
+  return 0;
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <SDL.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "utilities.hpp"
+#include "span.hpp"
+#include "tasks.hpp"
+
+// The renderer draws into memory of its own rather than into the window
+// surface. Rows start on cache lines, and the rasterizer marks the tiles it
+// writes. A frame clears only the tiles the previous one drew on, and only
+// tiles either frame touched are copied out and presented. Copied into
+// another framebuffer, tiles that come out the same are not presented again.
+
+#define TILE_SIZE 64
+#define FRAME_ALIGN 64
+#define UPSCALE_TASK_ROWS 32
+
+typedef struct framebuffer {
+  u32 *pixels;   // FRAME_ALIGN-aligned
+  int width, height;
+  int stride;    // pixels per row, a whole number of cache lines
+  int tiles_x, tiles_y;
+  SDL_PixelFormat *format;
+  std::vector<u8> drawn;   // tiles written since frame_begin
+  std::vector<u8> changed; // tiles that differ from what was last presented
+  u32 background;          // what every tile not drawn holds
+  bool fresh;              // nothing is known about the pixels yet
+} framebuffer;
+
+#define RENDER_SCALE_MIN 0.25f // smallest frame, as a fraction of the window
+
+// Frame sizes move in steps of 8 pixels, so small corrections do not
+// reallocate the framebuffer every frame.
+int render_size(int window, f32 scale) {
+  if (scale >= 1) return window;
+  return MIN(MAX(((int) (window * scale) + 4) & ~7, 8), window);
+}
+
+void framebuffer_init(framebuffer& fb, int width, int height, SDL_PixelFormat *format) {
+  fb.width = width;
+  fb.height = height;
+  fb.stride = (width + FRAME_ALIGN / 4 - 1) & ~(FRAME_ALIGN / 4 - 1);
+  fb.pixels = (u32 *) aligned_alloc(FRAME_ALIGN, (usize) fb.stride * height * sizeof(u32));
+  fb.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  fb.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  fb.format = format;
+  fb.drawn.assign(fb.tiles_x * fb.tiles_y, 0);
+  fb.changed.assign(fb.tiles_x * fb.tiles_y, 1);
+  fb.background = 0;
+  fb.fresh = true;
+}
+
+void framebuffer_free(framebuffer& fb) {
+  free(fb.pixels);
+  fb.pixels = NULL;
+}
+
+u32 *frame_row(framebuffer& fb, int y) {
+  return fb.pixels + (usize) y * fb.stride;
+}
+
+SDL_Rect tile_rect(framebuffer& fb, u32 tile) {
+  int x = (int) (tile % fb.tiles_x) * TILE_SIZE;
+  int y = (int) (tile / fb.tiles_x) * TILE_SIZE;
+  return (SDL_Rect) { x, y, MIN(TILE_SIZE, fb.width - x), MIN(TILE_SIZE, fb.height - y) };
+}
+
+// Tiles are whole cache lines wide except at the right edge, so the vector
+// stores in fill_pixels land aligned.
+void fill_tile(framebuffer& fb, u32 tile, u32 color) {
+  SDL_Rect r = tile_rect(fb, tile);
+  for (int y = r.y; y < r.y + r.h; y++) {
+    fill_pixels(frame_row(fb, y) + r.x, r.w, color);
+  }
+}
+
+// Marks the tiles of the non-empty half-open rectangle as drawn. Tasks that
+// each keep to their own tiles may call it at once.
+void mark_drawn(framebuffer& fb, int x0, int y0, int x1, int y1) {
+  for (int ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ty++) {
+    for (int tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; tx++) {
+      fb.drawn[ty * fb.tiles_x + tx] = 1;
+    }
+  }
+}
+
+// Starts a frame on `background`. The tiles the last frame drew on are
+// cleared, or every tile when the background changed.
+void frame_begin(framebuffer& fb, u32 background) {
+  bool all = fb.fresh || background != fb.background;
+  for (u32 t = 0; t < fb.drawn.size(); t++) {
+    if (all || fb.drawn[t]) {
+      fill_tile(fb, t, background);
+      fb.changed[t] = 1;
+    }
+    fb.drawn[t] = 0;
+  }
+  fb.background = background;
+  fb.fresh = false;
+}
+
+// Copies every tile that changed since the last call into `dst`, which has
+// the framebuffer's size and pixel format, and lists what it copied in
+// `rects`, one rectangle per run of tiles along a row.
+void frame_present(framebuffer& fb, SDL_Surface *dst, std::vector<SDL_Rect>& rects) {
+  rects.clear();
+  for (int ty = 0; ty < fb.tiles_y; ty++) {
+    usize first = rects.size();
+    for (int tx = 0; tx < fb.tiles_x; tx++) {
+      u32 t = ty * fb.tiles_x + tx;
+      if (!(fb.changed[t] | fb.drawn[t])) continue;
+      fb.changed[t] = 0;
+      SDL_Rect r = tile_rect(fb, t);
+      if (rects.size() > first && rects.back().x + rects.back().w == r.x) {
+	rects.back().w += r.w;
+      } else {
+	rects.push_back(r);
+      }
+    }
+    for (usize i = first; i < rects.size(); i++) {
+      SDL_Rect r = rects[i];
+      for (int y = r.y; y < r.y + r.h; y++) {
+	memcpy((u8 *) dst->pixels + (usize) y * dst->pitch + r.x * sizeof(u32), frame_row(fb, y) + r.x, r.w * sizeof(u32));
+      }
+    }
+  }
+}
+
+// frame_present into another framebuffer of the same size. Only rows that
+// differ from what `dst` holds are written, and only tiles that got one are
+// marked changed there, so redrawing the same picture presents nothing.
+void frame_copy(framebuffer& fb, framebuffer& dst) {
+  for (u32 t = 0; t < fb.changed.size(); t++) {
+    if (!(fb.changed[t] | fb.drawn[t])) continue;
+    fb.changed[t] = 0;
+    SDL_Rect r = tile_rect(fb, t);
+    for (int y = r.y; y < r.y + r.h; y++) {
+      u32 *to = frame_row(dst, y) + r.x;
+      const u32 *from = frame_row(fb, y) + r.x;
+      if (!memcmp(to, from, r.w * sizeof(u32))) continue;
+      memcpy(to, from, r.w * sizeof(u32));
+      dst.changed[t] = 1;
+    }
+  }
+}
+
+// Blends the four 8-bit channels of two pixels, `w` of 256 towards b, two
+// channels per multiply.
+u32 blend_pixels(u32 a, u32 b, u32 w) {
+  u32 rb = ((a & 0xff00ff) * (256 - w) + (b & 0xff00ff) * w) >> 8 & 0xff00ff;
+  u32 ag = ((a >> 8 & 0xff00ff) * (256 - w) + (b >> 8 & 0xff00ff) * w) & 0xff00ff00;
+  return rb | ag;
+}
+
+// blend_pixels over whole rows with one weight, four pixels at a time where
+// there is SSE2.
+void blend_rows(u32 *dst, const u32 *a, const u32 *b, u32 w, int count) {
+  int i = 0;
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i wa = _mm_set1_epi16(256 - w);
+  __m128i wb = _mm_set1_epi16(w);
+  for (; i + 4 <= count; i += 4) {
+    __m128i pa = _mm_loadu_si128((const __m128i *) (a + i));
+    __m128i pb = _mm_loadu_si128((const __m128i *) (b + i));
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = blend_pixels(a[i], b[i], w);
+  }
+}
+
+// Where output pixel i of `to` samples a row or column of `from` pixels: the
+// nearest one, or the two either side of its centre and the weight of the
+// second out of 256.
+typedef struct upscale_axis {
+  std::vector<u32> first, second, weight;
+} upscale_axis;
+
+void upscale_map(upscale_axis& a, int from, int to, bool bilinear) {
+  a.first.resize(to);
+  a.second.resize(to);
+  a.weight.resize(to);
+  for (int i = 0; i < to; i++) {
+    f32 at = (i + 0.5f) * from / to;
+    if (!bilinear) {
+      a.first[i] = a.second[i] = MIN((int) at, from - 1);
+      a.weight[i] = 0;
+      continue;
+    }
+    at = MAX(at - 0.5f, 0.0f);
+    int k = MIN((int) at, from - 1);
+    a.first[i] = k;
+    a.second[i] = MIN(k + 1, from - 1);
+    a.weight[i] = (u32) ((at - k) * 256);
+  }
+}
+
+void stretch_row(u32 *dst, const u32 *src, upscale_axis& xs, int count) {
+  for (int x = 0; x < count; x++) {
+    dst[x] = blend_pixels(src[xs.first[x]], src[xs.second[x]], xs.weight[x]);
+  }
+}
+
+// Bilinear filtering is done across first: each source row is stretched once
+// and kept while the output rows still blend from it.
+void upscale_rows(framebuffer& fb, framebuffer& dst, upscale_axis& xs, upscale_axis& ys, int from, int to, bool bilinear) {
+  std::vector<u32> rows[2];
+  int held[2] = { -1, -1 };
+  if (bilinear) {
+    rows[0].resize(dst.width);
+    rows[1].resize(dst.width);
+  }
+  for (int y = from; y < to; y++) {
+    u32 *out = frame_row(dst, y);
+    if (!bilinear) {
+      const u32 *src = frame_row(fb, ys.first[y]);
+      for (int x = 0; x < dst.width; x++) {
+	out[x] = src[xs.first[x]];
+      }
+      continue;
+    }
+    int a = ys.first[y];
+    int b = ys.second[y];
+    if (held[0] != a && held[1] == a) {
+      std::swap(rows[0], rows[1]);
+      std::swap(held[0], held[1]);
+    }
+    if (held[0] != a) {
+      stretch_row(rows[0].data(), frame_row(fb, a), xs, dst.width);
+      held[0] = a;
+    }
+    if (held[1] != b) {
+      stretch_row(rows[1].data(), frame_row(fb, b), xs, dst.width);
+      held[1] = b;
+    }
+    blend_rows(out, rows[0].data(), rows[1].data(), ys.weight[y], dst.width);
+  }
+}
+
+// Stretches the whole frame over `dst`, which is larger. Every tile of `fb`
+// counts as presented afterwards, and every tile of `dst` as changed.
+void frame_upscale(framebuffer& fb, framebuffer& dst, bool bilinear, task_pool *pool) {
+  upscale_axis xs, ys;
+  upscale_map(xs, fb.width, dst.width, bilinear);
+  upscale_map(ys, fb.height, dst.height, bilinear);
+  if (!pool || dst.height < 2 * UPSCALE_TASK_ROWS) {
+    upscale_rows(fb, dst, xs, ys, 0, dst.height, bilinear);
+  } else {
+    task_group group;
+    for (int from = 0; from < dst.height; from += UPSCALE_TASK_ROWS) {
+      int to = MIN(from + UPSCALE_TASK_ROWS, dst.height);
+      pool_spawn(*pool, group, [&fb, &dst, &xs, &ys, from, to, bilinear] {
+	upscale_rows(fb, dst, xs, ys, from, to, bilinear);
+      });
+    }
+    pool_wait(*pool, group);
+  }
+  std::fill(fb.changed.begin(), fb.changed.end(), 0);
+  std::fill(dst.changed.begin(), dst.changed.end(), 1);
+}
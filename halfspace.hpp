@@ -0,0 +1,25 @@
+#pragma once
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "utilities.hpp"
+
+// Bit i is set when e + offset[i] >= 0, for an 8-pixel run along one edge.
+u32 edge_mask8(i32 e, const i32 *offset) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_add_epi32(_mm256_set1_epi32(e), _mm256_loadu_si256((const __m256i *) offset));
+  return ~_mm256_movemask_ps(_mm256_castsi256_ps(v)) & 0xff;
+#elif defined(__SSE2__)
+  __m128i e4 = _mm_set1_epi32(e);
+  __m128i lo = _mm_add_epi32(e4, _mm_loadu_si128((const __m128i *) offset));
+  __m128i hi = _mm_add_epi32(e4, _mm_loadu_si128((const __m128i *) (offset + 4)));
+  return ~(_mm_movemask_ps(_mm_castsi128_ps(lo)) | _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4) & 0xff;
+#else
+  u32 mask = 0;
+  for (u32 i = 0; i < 8; i++) {
+    mask |= (u32) (e + offset[i] >= 0) << i;
+  }
+  return mask;
+#endif
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "utilities.hpp"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. It stays valid until unmap_file.
+typedef struct mapped_file {
+  const char *data;
+  usize size;
+  std::vector<char> copy; // used where mmap is not available
+} mapped_file;
+
+bool map_file(const char *path, mapped_file& m) {
+  m.data = "";
+  m.size = 0;
+#if defined(_WIN32)
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  m.copy.resize(MAX(size, 0));
+  m.size = fread(m.copy.data(), 1, m.copy.size(), f);
+  m.data = m.copy.data();
+  fclose(f);
+  return true;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+  if (st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    m.data = (const char *) data;
+    m.size = st.st_size;
+  }
+  close(fd);
+  return true;
+#endif
+}
+
+void unmap_file(mapped_file& m) {
+#if !defined(_WIN32)
+  if (m.size) munmap((void *) m.data, m.size);
+#endif
+  m.copy.clear();
+  m.data = "";
+  m.size = 0;
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "utilities.hpp"
+#include "tasks.hpp"
+#include "bsp.hpp"
+#include "mapped.hpp"
+
+const u8 OBJ_OK = 0;
+const u8 OBJ_NO_FILE = 1;
+const u8 OBJ_BAD_VERTEX = 2;
+const u8 OBJ_BAD_FACE = 3;
+
+#define OBJ_CHUNK_BYTES (1 << 20)
+
+bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+const char *skip_blanks(const char *p, const char *end) {
+  while (p < end && is_blank(*p)) p++;
+  return p;
+}
+
+const char *next_line(const char *p, const char *end) {
+  while (p < end && *p != '\n') p++;
+  return p < end ? p + 1 : p;
+}
+
+// Parses [sign] digits. Returns NULL when there is no number at p.
+const char *parse_int(const char *p, const char *end, i64& out) {
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+  if (p >= end || !is_digit(*p)) return NULL;
+  i64 n = 0;
+  for (; p < end && is_digit(*p); p++) {
+    n = n * 10 + (*p - '0');
+  }
+  out = negative ? -n : n;
+  return p;
+}
+
+// Parses [sign] digits [. digits] [e [sign] digits] without going through the
+// locale. Digits past the 18th only move the exponent. Returns NULL when there
+// is no number at p.
+const char *parse_float(const char *p, const char *end, f32& out) {
+  static const f64 exact[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+  u64 mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  int kept = 0;
+  for (; p < end && is_digit(*p); p++, digits++) {
+    if (kept < 18) {
+      mantissa = mantissa * 10 + (*p - '0');
+      kept += mantissa != 0;
+    } else {
+      exponent++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && is_digit(*p); p++, digits++) {
+      if (kept < 18) {
+	mantissa = mantissa * 10 + (*p - '0');
+	kept += mantissa != 0;
+	exponent--;
+      }
+    }
+  }
+  if (!digits) return NULL;
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    i64 e;
+    const char *q = parse_int(p + 1, end, e);
+    if (q) {
+      exponent += (int) MAX(MIN(e, 1000), -1000);
+      p = q;
+    }
+  }
+  f64 v = (f64) mantissa;
+  if (exponent < 0) {
+    v = -exponent <= 22 ? v / exact[-exponent] : v * pow(10.0, exponent);
+  } else if (exponent > 0) {
+    v = exponent <= 22 ? v * exact[exponent] : v * pow(10.0, exponent);
+  }
+  out = (f32) (negative ? -v : v);
+  return p;
+}
+
+// One line-aligned piece of the file. Face corners keep their OBJ numbering
+// until every chunk's vertex count is known.
+typedef struct obj_chunk {
+  const char *begin, *end;
+  std::vector<vec3> points;
+  std::vector<i64> corners; // three per triangle
+  std::vector<u32> seen;    // chunk vertices read before each triangle's face
+  std::vector<bool> joined; // triangle is part of the previous one's face
+  u8 error;
+} obj_chunk;
+
+// Reads `v` lines and `f` lines in the a, a/b, a/b/c and a//c forms. Faces
+// with more than three corners are split into a fan. Other lines are skipped.
+void parse_obj_chunk(obj_chunk& ch) {
+  const char *p = ch.begin;
+  const char *end = ch.end;
+  std::vector<i64> poly = {};
+  while (p < end && !ch.error) {
+    p = skip_blanks(p, end);
+    if (end - p > 1 && p[0] == 'v' && is_blank(p[1])) {
+      f32 xyz[3];
+      p++;
+      for (u32 k = 0; k < 3 && p; k++) {
+	p = parse_float(skip_blanks(p, end), end, xyz[k]);
+      }
+      if (!p) {
+	ch.error = OBJ_BAD_VERTEX;
+	return;
+      }
+      ch.points.push_back(cons3(xyz[0], xyz[1], xyz[2]));
+    } else if (end - p > 1 && p[0] == 'f' && is_blank(p[1])) {
+      poly.clear();
+      p = skip_blanks(p + 1, end);
+      while (p < end && *p != '\n' && *p != '#') {
+	i64 index, unused;
+	p = parse_int(p, end, index);
+	if (!p || !index) {
+	  ch.error = OBJ_BAD_FACE;
+	  return;
+	}
+	for (u32 k = 0; k < 2 && p < end && *p == '/'; k++) {
+	  const char *q = parse_int(p + 1, end, unused);
+	  p = q ? q : p + 1;
+	}
+	if (p < end && !is_blank(*p) && *p != '\n' && *p != '#') {
+	  ch.error = OBJ_BAD_FACE;
+	  return;
+	}
+	poly.push_back(index);
+	p = skip_blanks(p, end);
+      }
+      if (poly.size() < 3) {
+	ch.error = OBJ_BAD_FACE;
+	return;
+      }
+      for (usize k = 1; k + 1 < poly.size(); k++) {
+	ch.corners.push_back(poly[0]);
+	ch.corners.push_back(poly[k]);
+	ch.corners.push_back(poly[k + 1]);
+	ch.seen.push_back(ch.points.size());
+	ch.joined.push_back(k > 1);
+      }
+    }
+    p = next_line(p, end);
+  }
+}
+
+// Turns the chunk's corners into 0-based indices: positive ones count from the
+// start of the file, negative ones back from the last vertex read so far.
+void resolve_obj_chunk(obj_chunk& ch, u32 first_point, u32 point_count, vec3 *points, triangle *faces) {
+  std::copy(ch.points.begin(), ch.points.end(), points);
+  for (usize t = 0; t < ch.seen.size(); t++) {
+    u32 v[3];
+    for (u32 k = 0; k < 3; k++) {
+      i64 index = ch.corners[t * 3 + k];
+      index = index > 0 ? index - 1 : first_point + ch.seen[t] + index;
+      if (index < 0 || index >= point_count) {
+	ch.error = OBJ_BAD_FACE;
+	return;
+      }
+      v[k] = (u32) index;
+    }
+    faces[t] = (triangle) { v[0], v[1], v[2], 0 };
+  }
+}
+
+// Replaces points and faces with the contents of an OBJ file. Files larger
+// than a chunk are parsed in parallel when there is a pool. Faces get random
+// colors, one per face however many triangles it was split into.
+u8 load_obj(const char *path, std::vector<vec3>& points, std::vector<triangle>& faces, task_pool *pool) {
+  points.clear();
+  faces.clear();
+  mapped_file file = {};
+  if (!map_file(path, file)) {
+    return OBJ_NO_FILE;
+  }
+
+  usize count = 1;
+  if (pool) {
+    count = MAX(MIN(file.size / OBJ_CHUNK_BYTES, (pool->threads.size() + 1) * 4), 1);
+  }
+  std::vector<obj_chunk> chunks(count);
+  const char *end = file.data + file.size;
+  for (usize i = 0; i < count; i++) {
+    chunks[i].begin = i ? chunks[i - 1].end : file.data;
+    chunks[i].end = i + 1 < count ? next_line(MAX(file.data + file.size * (i + 1) / count, chunks[i].begin), end) : end;
+  }
+
+  task_group group;
+  for (usize i = 0; i < count; i++) {
+    if (pool && count > 1) {
+      pool_spawn(*pool, group, [&chunks, i] { parse_obj_chunk(chunks[i]); });
+    } else {
+      parse_obj_chunk(chunks[i]);
+    }
+  }
+  if (pool && count > 1) pool_wait(*pool, group);
+
+  u8 error = OBJ_OK;
+  usize point_count = 0;
+  usize face_count = 0;
+  std::vector<usize> first_point(count), first_face(count);
+  for (usize i = 0; i < count && !error; i++) {
+    error = chunks[i].error;
+    first_point[i] = point_count;
+    first_face[i] = face_count;
+    point_count += chunks[i].points.size();
+    face_count += chunks[i].seen.size();
+  }
+  if (error) {
+    unmap_file(file);
+    return error;
+  }
+
+  points.resize(point_count);
+  faces.resize(face_count);
+  for (usize i = 0; i < count; i++) {
+    auto resolve = [&, i] { resolve_obj_chunk(chunks[i], first_point[i], point_count, points.data() + first_point[i], faces.data() + first_face[i]); };
+    if (pool && count > 1) {
+      pool_spawn(*pool, group, resolve);
+    } else {
+      resolve();
+    }
+  }
+  if (pool && count > 1) pool_wait(*pool, group);
+  unmap_file(file);
+
+  for (usize i = 0; i < count && !error; i++) {
+    error = chunks[i].error;
+  }
+  if (error) {
+    points.clear();
+    faces.clear();
+    return error;
+  }
+  u32 color = 0;
+  for (usize i = 0; i < count; i++) {
+    for (usize t = 0; t < chunks[i].joined.size(); t++) {
+      if (!chunks[i].joined[t]) {
+	f32 red = RANDF;
+	f32 green = RANDF;
+	f32 blue = RANDF;
+	color = pack_color(red, green, blue);
+      }
+      faces[first_face[i] + t].color = color;
+    }
+  }
+  return OBJ_OK;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include "utilities.hpp"
+
+// Where frame time goes, without an external profiler: stage times from
+// scoped timers and counts from the renderer, kept for the last
+// PROFILE_FRAMES frames.
+
+#define PROFILE_FRAMES 120
+
+const u8 PROFILE_CLEAR = 0;
+const u8 PROFILE_PROJECT = 1;
+const u8 PROFILE_ORDER = 2;   // traversal into the stream
+const u8 PROFILE_RASTER = 3;  // includes the traversal when nearest-first draws as it goes
+const u8 PROFILE_PRESENT = 4;
+const u8 PROFILE_FRAME = 5;
+const u8 PROFILE_NODES = 6;     // subtrees the traversal visited
+const u8 PROFILE_TRIANGLES = 7; // sent to the rasterizer, after near clipping
+const u8 PROFILE_PIXELS = 8;    // pixel writes, overdraw included
+const u8 PROFILE_EDITOR = 9;    // one pass of the editor loop, vsync included
+const u8 PROFILE_SCALE = 10;    // render width as a percentage of the window's
+#define PROFILE_SERIES 11
+
+const char *profile_names[PROFILE_SERIES] = { "Clear", "Project", "Order", "Raster", "Present", "Frame", "Nodes", "Triangles", "Pixels", "Editor", "Scale %" };
+
+bool profile_is_time(u32 series) {
+  return series < PROFILE_NODES || series == PROFILE_EDITOR;
+}
+
+// Times in milliseconds, counts as they are. Whoever draws the frame zeroes it
+// first; everything after adds to it.
+typedef struct frame_profile {
+  f32 values[PROFILE_SERIES];
+} frame_profile;
+
+// Ring of the last frames, oldest at `next` once it has wrapped.
+typedef struct profile_history {
+  f32 values[PROFILE_SERIES][PROFILE_FRAMES];
+  u32 next, count;
+} profile_history;
+
+void profile_push(profile_history& h, const frame_profile& f) {
+  for (u32 s = 0; s < PROFILE_SERIES; s++) {
+    h.values[s][h.next] = f.values[s];
+  }
+  h.next = (h.next + 1) % PROFILE_FRAMES;
+  h.count = MIN(h.count + 1, PROFILE_FRAMES);
+}
+
+// Oldest first, so the ring plots left to right.
+u32 profile_offset(profile_history& h) {
+  return h.count < PROFILE_FRAMES ? 0 : h.next;
+}
+
+f32 profile_latest(profile_history& h, u32 series) {
+  return h.count ? h.values[series][(h.next + PROFILE_FRAMES - 1) % PROFILE_FRAMES] : 0;
+}
+
+f32 profile_mean(profile_history& h, u32 series) {
+  f32 total = 0;
+  for (u32 i = 0; i < h.count; i++) {
+    total += h.values[series][i];
+  }
+  return h.count ? total / h.count : 0;
+}
+
+// Adds the time between construction and the end of the scope to *out.
+struct scoped_timer {
+  f32 *out;
+  std::chrono::steady_clock::time_point start;
+  scoped_timer(f32 *out) : out(out), start(std::chrono::steady_clock::now()) {}
+  ~scoped_timer() {
+    *out += std::chrono::duration<f32, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+};
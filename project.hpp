@@ -0,0 +1,108 @@
+#pragma once
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "utilities.hpp"
+
+// Depth, in w, below which a point counts as behind the eye.
+#define NEAR_W 0.01f
+
+// to_4h_2(mul4(to_3_4h(p), m)) for `count` points. Products are summed in
+// dot4's order, so lanes give the same screen positions as the scalar path.
+// Points nearer than NEAR_W get NaN for x, which triangles that use them have
+// to be clipped for.
+void project_points(mat4 m, const vec3 *in, usize count, vec2 *out) {
+  usize i = 0;
+#if defined(__AVX2__)
+  const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  for (; i + 8 <= count; i += 8) {
+    const f32 *p = (const f32 *) (in + i);
+    __m256 px = _mm256_i32gather_ps(p, stride, 4);
+    __m256 py = _mm256_i32gather_ps(p + 1, stride, 4);
+    __m256 pz = _mm256_i32gather_ps(p + 2, stride, 4);
+    __m256 x = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(m.x.x)), _mm256_mul_ps(py, _mm256_set1_ps(m.x.y))), _mm256_mul_ps(pz, _mm256_set1_ps(m.x.z))), _mm256_set1_ps(m.x.w));
+    __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(m.y.x)), _mm256_mul_ps(py, _mm256_set1_ps(m.y.y))), _mm256_mul_ps(pz, _mm256_set1_ps(m.y.z))), _mm256_set1_ps(m.y.w));
+    __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(m.w.x)), _mm256_mul_ps(py, _mm256_set1_ps(m.w.y))), _mm256_mul_ps(pz, _mm256_set1_ps(m.w.z))), _mm256_set1_ps(m.w.w));
+    __m256 sx = _mm256_div_ps(x, w);
+    __m256 sy = _mm256_div_ps(y, w);
+    sx = _mm256_blendv_ps(sx, _mm256_set1_ps(NAN), _mm256_cmp_ps(w, _mm256_set1_ps(NEAR_W), _CMP_NGE_UQ));
+    __m256 lo = _mm256_unpacklo_ps(sx, sy);
+    __m256 hi = _mm256_unpackhi_ps(sx, sy);
+    _mm256_storeu_ps((f32 *) (out + i), _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps((f32 *) (out + i + 4), _mm256_permute2f128_ps(lo, hi, 0x31));
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 4 <= count; i += 4) {
+    const vec3 *p = in + i;
+    __m128 px = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+    __m128 py = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+    __m128 pz = _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[3].z);
+    __m128 x = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(m.x.x)), _mm_mul_ps(py, _mm_set1_ps(m.x.y))), _mm_mul_ps(pz, _mm_set1_ps(m.x.z))), _mm_set1_ps(m.x.w));
+    __m128 y = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(m.y.x)), _mm_mul_ps(py, _mm_set1_ps(m.y.y))), _mm_mul_ps(pz, _mm_set1_ps(m.y.z))), _mm_set1_ps(m.y.w));
+    __m128 w = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(m.w.x)), _mm_mul_ps(py, _mm_set1_ps(m.w.y))), _mm_mul_ps(pz, _mm_set1_ps(m.w.z))), _mm_set1_ps(m.w.w));
+    __m128 sx = _mm_div_ps(x, w);
+    __m128 sy = _mm_div_ps(y, w);
+    __m128 near = _mm_cmpnge_ps(w, _mm_set1_ps(NEAR_W));
+    sx = _mm_or_ps(_mm_andnot_ps(near, sx), _mm_and_ps(near, _mm_set1_ps(NAN)));
+    _mm_storeu_ps((f32 *) (out + i), _mm_unpacklo_ps(sx, sy));
+    _mm_storeu_ps((f32 *) (out + i + 2), _mm_unpackhi_ps(sx, sy));
+  }
+#endif
+  for (; i < count; i++) {
+    vec4 h = mul4(to_3_4h(in[i]), m);
+    out[i] = to_4h_2(h);
+    if (!(h.w >= NEAR_W)) out[i].x = NAN;
+  }
+}
+
+#if defined(__SSE2__)
+// Writes four points held as x, y and z lanes out as packed vec3s.
+void store_xyz4(f32 *out, __m128 x, __m128 y, __m128 z) {
+  __m128 xy_lo = _mm_unpacklo_ps(x, y); // x0 y0 x1 y1
+  __m128 xy_hi = _mm_unpackhi_ps(x, y); // x2 y2 x3 y3
+  __m128 a = _mm_shuffle_ps(z, xy_lo, _MM_SHUFFLE(3, 2, 0, 0));
+  __m128 b = _mm_shuffle_ps(xy_lo, z, _MM_SHUFFLE(1, 1, 3, 3));
+  __m128 c = _mm_shuffle_ps(z, xy_hi, _MM_SHUFFLE(2, 2, 2, 2));
+  __m128 d = _mm_shuffle_ps(xy_hi, z, _MM_SHUFFLE(3, 3, 3, 3));
+  _mm_storeu_ps(out, _mm_shuffle_ps(xy_lo, a, _MM_SHUFFLE(2, 0, 1, 0)));
+  _mm_storeu_ps(out + 4, _mm_shuffle_ps(b, xy_hi, _MM_SHUFFLE(1, 0, 2, 0)));
+  _mm_storeu_ps(out + 8, _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#endif
+
+// to_4_3(mul4(to_3_4h(p), m)) for `count` points, for affine `m`. Summed in
+// dot4's order like project_points, so every path gives the same points.
+void transform_points(mat4 m, const vec3 *in, usize count, vec3 *out) {
+  usize i = 0;
+#if defined(__AVX2__)
+  const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  for (; i + 8 <= count; i += 8) {
+    const f32 *p = (const f32 *) (in + i);
+    __m256 px = _mm256_i32gather_ps(p, stride, 4);
+    __m256 py = _mm256_i32gather_ps(p + 1, stride, 4);
+    __m256 pz = _mm256_i32gather_ps(p + 2, stride, 4);
+    __m256 x = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(m.x.x)), _mm256_mul_ps(py, _mm256_set1_ps(m.x.y))), _mm256_mul_ps(pz, _mm256_set1_ps(m.x.z))), _mm256_set1_ps(m.x.w));
+    __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(m.y.x)), _mm256_mul_ps(py, _mm256_set1_ps(m.y.y))), _mm256_mul_ps(pz, _mm256_set1_ps(m.y.z))), _mm256_set1_ps(m.y.w));
+    __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(m.z.x)), _mm256_mul_ps(py, _mm256_set1_ps(m.z.y))), _mm256_mul_ps(pz, _mm256_set1_ps(m.z.z))), _mm256_set1_ps(m.z.w));
+    store_xyz4((f32 *) (out + i), _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z));
+    store_xyz4((f32 *) (out + i + 4), _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1));
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 4 <= count; i += 4) {
+    const vec3 *p = in + i;
+    __m128 px = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+    __m128 py = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+    __m128 pz = _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[3].z);
+    __m128 x = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(m.x.x)), _mm_mul_ps(py, _mm_set1_ps(m.x.y))), _mm_mul_ps(pz, _mm_set1_ps(m.x.z))), _mm_set1_ps(m.x.w));
+    __m128 y = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(m.y.x)), _mm_mul_ps(py, _mm_set1_ps(m.y.y))), _mm_mul_ps(pz, _mm_set1_ps(m.y.z))), _mm_set1_ps(m.y.w));
+    __m128 z = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(m.z.x)), _mm_mul_ps(py, _mm_set1_ps(m.z.y))), _mm_mul_ps(pz, _mm_set1_ps(m.z.z))), _mm_set1_ps(m.z.w));
+    store_xyz4((f32 *) (out + i), x, y, z);
+  }
+#endif
+  for (; i < count; i++) {
+    out[i] = to_4_3(mul4(to_3_4h(in[i]), m));
+  }
+}
@@ -0,0 +1,713 @@
+#pragma once
+
+#include <SDL.h>
+#include <vector>
+#include "utilities.hpp"
+#include "tasks.hpp"
+#include "bsp.hpp"
+#include "project.hpp"
+#include "span.hpp"
+#include "halfspace.hpp"
+#include "profile.hpp"
+#include "framebuffer.hpp"
+
+#define RWINDOW_WIDTH 600
+#define RWINDOW_HEIGHT 600
+
+typedef struct camera {
+  vec3 pos, rot;
+  vec3 bg_col;
+  // Onto a unit frame, x and y in [0, 1]. render_model scales it to the
+  // frame and stretches y by width / height first, so pixels stay square.
+  mat4 view;
+} camera;
+
+// Half-open pixel rectangle.
+typedef struct screen_rect {
+  int x0, y0, x1, y1;
+} screen_rect;
+
+screen_rect frame_rect(framebuffer& fb) {
+  return (screen_rect) { 0, 0, fb.width, fb.height };
+}
+
+screen_rect clip_rect(screen_rect a, screen_rect b) {
+  return (screen_rect) { MAX(a.x0, b.x0), MAX(a.y0, b.y0), MIN(a.x1, b.x1), MIN(a.y1, b.y1) };
+}
+
+// Pixels a triangle may touch inside `screen`, which starts at 0, 0. Empty
+// when a corner is not finite.
+screen_rect triangle_bounds(vec2 a, vec2 b, vec2 c, screen_rect screen) {
+  f32 x0 = MIN(MIN(a.x, b.x), c.x);
+  f32 y0 = MIN(MIN(a.y, b.y), c.y);
+  f32 x1 = MAX(MAX(a.x, b.x), c.x);
+  f32 y1 = MAX(MAX(a.y, b.y), c.y);
+  if (!(x0 < screen.x1 && y0 < screen.y1 && x1 >= 0 && y1 >= 0 && x0 == x0 && y0 == y0 && x1 == x1 && y1 == y1)) {
+    return (screen_rect) { 0, 0, 0, 0 };
+  }
+  return (screen_rect) { (int) MAX(x0, 0), (int) MAX(y0, 0), (int) MIN(x1, screen.x1 - 1) + 1, (int) MIN(y1, screen.y1 - 1) + 1 };
+}
+
+typedef struct span {
+  int x0, x1;
+} span;
+
+// Every pixel write goes through write_pixels, which counts it for the
+// profile. With `raster_overdraw` set a write adds one to the pixel instead
+// of storing a colour, leaving the write count for shade_overdraw. Both are
+// per thread so tiles need not share them.
+thread_local u64 raster_pixels = 0;
+thread_local bool raster_overdraw = false;
+
+void write_pixels(u32 *dst, int count, u32 color) {
+  raster_pixels += count;
+  if (raster_overdraw) {
+    for (int i = 0; i < count; i++) {
+      dst[i]++;
+    }
+  } else {
+    fill_pixels(dst, count, color);
+  }
+}
+
+// Pixels already written inside `rect`, kept per row as sorted spans that
+// neither overlap nor touch.
+typedef struct coverage {
+  screen_rect rect;
+  std::vector<std::vector<span>> rows;
+  u32 covered;
+} coverage;
+
+void coverage_reset(coverage& cov, screen_rect rect) {
+  cov.rect = rect;
+  cov.rows.resize(rect.y1 - rect.y0);
+  for (usize i = 0; i < cov.rows.size(); i++) {
+    cov.rows[i].clear();
+  }
+  cov.covered = 0;
+}
+
+bool coverage_full(coverage& cov) {
+  return cov.covered == (u32) ((cov.rect.x1 - cov.rect.x0) * (cov.rect.y1 - cov.rect.y0));
+}
+
+// Writes only the pixels of [x0, x1) on row y nobody has written yet, then
+// merges the span into the row.
+void cover_span(coverage& cov, u32 *row, int y, int x0, int x1, u32 color) {
+  std::vector<span>& spans = cov.rows[y - cov.rect.y0];
+  usize first = 0;
+  while (first < spans.size() && spans[first].x1 < x0) first++;
+  usize last = first;
+  span merged = (span) { x0, x1 };
+  int x = x0;
+  while (last < spans.size() && spans[last].x0 <= x1) {
+    span s = spans[last++];
+    if (x < s.x0) {
+      cov.covered += s.x0 - x;
+      write_pixels(row + x, s.x0 - x, color);
+    }
+    x = MAX(x, s.x1);
+    merged.x0 = MIN(merged.x0, s.x0);
+    merged.x1 = MAX(merged.x1, s.x1);
+  }
+  if (x < x1) {
+    cov.covered += x1 - x;
+    write_pixels(row + x, x1 - x, color);
+  }
+  spans.erase(spans.begin() + first, spans.begin() + last);
+  spans.insert(spans.begin() + first, merged);
+}
+
+#define FIX_BITS 16
+#define FIX_ONE (1 << FIX_BITS)
+
+// Span ends and edge slopes are stepped in fixed point. Anything beyond
+// 2^30 pixels is clipped away anyway.
+i64 to_fixed(f32 v) {
+  return (i64) (MAX(MIN(v, 1 << 30), -(1 << 30)) * FIX_ONE);
+}
+
+// Fills pixel x >> FIX_BITS for x = from, from + FIX_ONE, ... while below `to`
+// (or up to it when `closed`), limited to `clip`. With `cov` set, pixels
+// written earlier in the frame are kept.
+void fill_span(u32 *row, screen_rect clip, coverage *cov, int y, i64 from, i64 to, bool closed, u32 color) {
+  from = MAX(from, 0);
+  if (!(closed ? from <= to : from < to)) return;
+  i64 first = from >> FIX_BITS;
+  i64 count = closed ? ((to - from) >> FIX_BITS) + 1 : (to - from + FIX_ONE - 1) >> FIX_BITS;
+  int x0 = (int) MAX(first, (i64) clip.x0);
+  int x1 = (int) MIN(first + count, (i64) clip.x1);
+  if (x0 >= x1) return;
+  if (cov) {
+    cover_span(*cov, row, y, x0, x1, color);
+  } else {
+    write_pixels(row + x0, x1 - x0, color);
+  }
+}
+
+// Fills rows (int) (from + k) for from + k below `to` (or up to it when
+// `closed`), moving the span ends by si and ei each row. Rows above the clip
+// are skipped in one step, which is exact in fixed point.
+void fill_rows(framebuffer& fb, screen_rect clip, coverage *cov, f32 from, f32 to, bool closed, i64& start, i64& end, i64 si, i64 ei, bool closed_spans, u32 color) {
+  to = MIN(to, clip.y1);
+  if (!(closed ? from <= to : from < to)) return;
+  f32 rows = MIN(to - from, fb.height);
+  int count = closed ? (int) rows + 1 : (int) ceil(rows);
+  int y = (int) from;
+  int skip = MIN(MAX(clip.y0 - y, 0), count);
+  start += si * skip;
+  end += ei * skip;
+  for (y += skip, count -= skip; count > 0 && y < clip.y1; y++, count--) {
+    fill_span(frame_row(fb, y), clip, cov, y, start, end, closed_spans, color);
+    start += si;
+    end += ei;
+  }
+}
+
+// `color` is a pixel value in the framebuffer's format.
+void draw_triangle(framebuffer& fb, screen_rect clip, coverage *cov, vec2 p0, vec2 p1, vec2 p2, u32 color) {
+  clip = clip_rect(clip, triangle_bounds(p0, p1, p2, frame_rect(fb)));
+  if (clip.x0 >= clip.x1 || clip.y0 >= clip.y1) return;
+
+  vec2 a = p0;
+  vec2 b = p1;
+  vec2 c = p2;
+  if (b.y < a.y) std::swap(a, b);
+  if (c.y < b.y) std::swap(b, c);
+  if (b.y < a.y) std::swap(a, b);
+
+  f32 A = (b.x - c.x) / (b.y - c.y);
+  f32 B = (a.x - c.x) / (a.y - c.y);
+  f32 C = (a.x - b.x) / (a.y - b.y);
+
+  if (dist(a.y, b.y) <= 1.0) {
+    f32 start = MIN(a.x, b.x);
+    f32 end = MAX(a.x, b.x);
+    f32 si = MAX(A, B);
+    f32 ei = MIN(A, B);
+
+    if (a.y < 0) {
+      start += si * -a.y;
+      end += ei * -a.y;
+      a.y = 0;
+      b.y = 0;
+    }
+
+    i64 fs = to_fixed(start);
+    i64 fe = to_fixed(end);
+    fill_rows(fb, clip, cov, a.y, c.y, false, fs, fe, to_fixed(si), to_fixed(ei), false, color);
+  } else if (dist(b.y, c.y) < 1.0) {
+    f32 start = a.x;
+    f32 end = a.x;
+    f32 si = MIN(B, C);
+    f32 ei = MAX(B, C);
+
+    if (a.y < 0) {
+      start += si * -a.y;
+      end += ei * -a.y;
+      a.y = 0;
+    }
+
+    i64 fs = to_fixed(start);
+    i64 fe = to_fixed(end);
+    fill_rows(fb, clip, cov, (int) a.y, (int) MIN(c.y, clip.y1), false, fs, fe, to_fixed(si), to_fixed(ei), false, color);
+  } else {
+    f32 pas, pbs, pae, pbe;
+    bool over = C < B;
+    if (over) {
+      pas = C;
+      pae = B;
+      pbs = A;
+      pbe = B;
+    } else {
+      pas = B;
+      pae = C;
+      pbs = B;
+      pbe = A;
+    }
+    
+    f32 start = a.x;
+    f32 end = a.x;
+
+    if (a.y < 0) {
+      if (b.y < 0) {
+	start += (pas * -a.y) + (pbs * (b.y - a.y));
+	end += (pae * -a.y) + (pbe * (b.y - a.y));
+	a.y = 0;
+	b.y = 0;
+      } else {
+	start += (pas * -a.y);
+	end += (pae * -a.y);
+	a.y = 0;
+      }
+    }
+
+    i64 fs = to_fixed(start);
+    i64 fe = to_fixed(end);
+    fill_rows(fb, clip, cov, a.y, b.y, false, fs, fe, to_fixed(pas), to_fixed(pae), true, color);
+
+    i64 fbx = to_fixed(b.x);
+    if (over) {
+      if (fs < fbx) {
+	fs = fbx;
+      }
+    } else {
+      if (fe > fbx) {
+	fe = fbx;
+      }
+    }
+    
+    fill_rows(fb, clip, cov, b.y, c.y, true, fs, fe, to_fixed(pbs), to_fixed(pbe), true, color);
+  }
+}
+
+#define SUBPIXEL_BITS 4
+#define BLOCK_SIZE 8
+// Past this the edge values of a partly covered block no longer fit in i32.
+#define GUARD_BAND 65536.0f
+
+typedef struct edge {
+  i64 a, b, c;
+  i32 offset[BLOCK_SIZE];
+} edge;
+
+// Writes [x0, x1) on row y, through the coverage buffer when there is one.
+void fill_run(u32 *row, coverage *cov, int y, int x0, int x1, u32 color) {
+  if (cov) {
+    cover_span(*cov, row, y, x0, x1, color);
+  } else {
+    write_pixels(row + x0, x1 - x0, color);
+  }
+}
+
+// Edge functions sampled at pixel centres over 8x8 blocks. Blocks outside any
+// edge are skipped and edges a block lies wholly inside are not evaluated.
+// Ties follow the top-left rule, so triangles sharing an edge never both
+// write the pixels on it.
+void draw_triangle_halfspace(framebuffer& fb, screen_rect clip, coverage *cov, vec2 p0, vec2 p1, vec2 p2, u32 color) {
+  clip = clip_rect(clip, triangle_bounds(p0, p1, p2, frame_rect(fb)));
+  if (clip.x0 >= clip.x1 || clip.y0 >= clip.y1) return;
+  vec2 v[3] = { p0, p1, p2 };
+  for (u32 i = 0; i < 3; i++) {
+    if (fabs(v[i].x) >= GUARD_BAND || fabs(v[i].y) >= GUARD_BAND) {
+      draw_triangle(fb, clip, cov, p0, p1, p2, color);
+      return;
+    }
+  }
+
+  i64 X[3], Y[3];
+  for (u32 i = 0; i < 3; i++) {
+    X[i] = llround(v[i].x * (1 << SUBPIXEL_BITS));
+    Y[i] = llround(v[i].y * (1 << SUBPIXEL_BITS));
+  }
+  i64 area = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+  if (area == 0) return;
+  if (area < 0) {
+    std::swap(X[1], X[2]);
+    std::swap(Y[1], Y[2]);
+  }
+
+  const i64 half = 1 << (SUBPIXEL_BITS - 1);
+  edge e[3];
+  for (u32 k = 0; k < 3; k++) {
+    u32 n = (k + 1) % 3;
+    i64 A = Y[k] - Y[n];
+    i64 B = X[n] - X[k];
+    e[k].a = A * (1 << SUBPIXEL_BITS);
+    e[k].b = B * (1 << SUBPIXEL_BITS);
+    e[k].c = A * (half - X[k]) + B * (half - Y[k]) - (A > 0 || (A == 0 && B > 0) ? 0 : 1);
+    for (u32 i = 0; i < BLOCK_SIZE; i++) {
+      e[k].offset[i] = (i32) (e[k].a * i);
+    }
+  }
+
+  for (int by = clip.y0 & ~(BLOCK_SIZE - 1); by < clip.y1; by += BLOCK_SIZE) {
+    int y0 = MAX(by, clip.y0);
+    int y1 = MIN(by + BLOCK_SIZE, clip.y1);
+    for (int bx = clip.x0 & ~(BLOCK_SIZE - 1); bx < clip.x1; bx += BLOCK_SIZE) {
+      int x0 = MAX(bx, clip.x0);
+      int x1 = MIN(bx + BLOCK_SIZE, clip.x1);
+      i64 corner[3];
+      u32 partial = 0;
+      bool outside = false;
+      for (u32 k = 0; k < 3 && !outside; k++) {
+	corner[k] = e[k].a * bx + e[k].b * by + e[k].c;
+	i64 lo = corner[k] + (MIN(e[k].a, 0) + MIN(e[k].b, 0)) * (BLOCK_SIZE - 1);
+	i64 hi = corner[k] + (MAX(e[k].a, 0) + MAX(e[k].b, 0)) * (BLOCK_SIZE - 1);
+	outside = hi < 0;
+	partial |= (u32) (lo < 0) << k;
+      }
+      if (outside) continue;
+
+      u32 lanes = ((1u << (x1 - bx)) - 1) & ~((1u << (x0 - bx)) - 1);
+      for (int y = y0; y < y1; y++) {
+	u32 *row = frame_row(fb, y);
+	u32 mask = lanes;
+	for (u32 k = 0; k < 3; k++) {
+	  if (partial & (1 << k)) {
+	    mask &= edge_mask8((i32) (corner[k] + e[k].b * (y - by)), e[k].offset);
+	  }
+	}
+	if (!mask) continue;
+	fill_run(row, cov, y, bx + __builtin_ctz(mask), bx + 32 - __builtin_clz(mask), color);
+      }
+    }
+  }
+}
+
+#define BSP_DRAW 0x80000000u
+
+// Pushes what is left to do at `top` so that it pops in painter's order (far
+// side, the node, near side), or the other way round with `nearest_first`.
+// A node's own triangles only face the eye when it is in front of them.
+void push_node(std::vector<u32>& stack, const bsp_node& node, u32 top, vec3 eye, bool nearest_first) {
+  u8 result = behind_plane(eye, node.plane);
+  u32 first = result == 1 ? node.front : node.back;
+  u32 second = result == 1 ? node.back : node.front;
+  if (nearest_first) std::swap(first, second);
+  if (second != BSP_NONE) stack.push_back(second);
+  if (result == 0) stack.push_back(top | BSP_DRAW);
+  if (first != BSP_NONE) stack.push_back(first);
+}
+
+// World-space planes with the visible side positive: the four screen edges and
+// NEAR_W.
+typedef struct frustum {
+  vec4 planes[5];
+} frustum;
+
+// `view` maps world points to x, y and w with the screen position at x / w,
+// y / w, so each edge is a linear function of those rows.
+frustum view_frustum(mat4 view, screen_rect screen) {
+  frustum f;
+  f.planes[0] = sub4(view.x, mul4(view.w, screen.x0));
+  f.planes[1] = sub4(mul4(view.w, screen.x1), view.x);
+  f.planes[2] = sub4(view.y, mul4(view.w, screen.y0));
+  f.planes[3] = sub4(mul4(view.w, screen.y1), view.y);
+  f.planes[4] = sub4(view.w, cons4(0, 0, 0, NEAR_W));
+  return f;
+}
+
+// False when the box lies wholly outside one of the planes. Boxes that only
+// straddle corners outside the frustum still pass.
+bool box_visible(frustum& f, vec3 lo, vec3 hi) {
+  for (u32 i = 0; i < 5; i++) {
+    vec4 p = f.planes[i];
+    vec3 far = cons3(p.x >= 0 ? hi.x : lo.x, p.y >= 0 ? hi.y : lo.y, p.z >= 0 ? hi.z : lo.z);
+    if (p.x * far.x + p.y * far.y + p.z * far.z + p.w < 0) return false;
+  }
+  return true;
+}
+
+#define PROJECT_TASK_GRAIN 16384
+
+const u8 RASTER_SCANLINE = 0;
+const u8 RASTER_HALFSPACE = 1;
+
+// Stream entries with this bit index rs.clipped instead of the tree's
+// triangles.
+#define STREAM_CLIPPED 0x80000000u
+
+// Scratch kept across frames so the per-frame buffers are only grown, never
+// reallocated.
+typedef struct render_state {
+  std::vector<vec2> screen; // projected points, then corners made by clipping
+  std::vector<u32> stream;
+  std::vector<triangle> clipped;
+  std::vector<std::vector<u32>> bins; // one per framebuffer tile
+  coverage cover;
+  std::vector<coverage> tile_cover;
+  std::vector<u64> tile_pixels;
+  mat4 view;
+  frustum clip;
+  u32 raster;
+  bool tiled;
+  bool nearest_first;
+  bool overdraw; // write counts instead of colours, see shade_overdraw
+  task_pool *pool;
+  frame_profile profile;
+} render_state;
+
+// Packed colours already are RGB888 pixels; other layouts go through SDL.
+u32 surface_color(SDL_PixelFormat *format, u32 color) {
+  if (format->Rmask == 0xff0000 && format->Gmask == 0xff00 && format->Bmask == 0xff) {
+    return color | format->Amask;
+  }
+  return SDL_MapRGB(format, color >> 16 & 0xff, color >> 8 & 0xff, color & 0xff);
+}
+
+void raster_triangle(framebuffer& fb, render_state& rs, screen_rect clip, coverage *cov, const triangle& t) {
+  vec2 a = rs.screen[t.p0];
+  vec2 b = rs.screen[t.p1];
+  vec2 c = rs.screen[t.p2];
+  u32 color = surface_color(fb.format, t.color);
+  screen_rect r = clip_rect(clip, triangle_bounds(a, b, c, frame_rect(fb)));
+  if (r.x0 >= r.x1 || r.y0 >= r.y1) return;
+  mark_drawn(fb, r.x0, r.y0, r.x1, r.y1);
+  raster_overdraw = rs.overdraw;
+  if (rs.raster == RASTER_HALFSPACE) {
+    draw_triangle_halfspace(fb, clip, cov, a, b, c, color);
+  } else {
+    draw_triangle(fb, clip, cov, a, b, c, color);
+  }
+}
+
+// The traversal below is written once over the node and triangle types, so a
+// compacted tree is walked through its 16-bit arrays directly.
+template <typename T>
+triangle streamed(render_state& rs, const T *tris, u32 entry) {
+  return entry & STREAM_CLIPPED ? rs.clipped[entry & ~STREAM_CLIPPED] : wide_tri(tris[entry]);
+}
+
+// Cuts the part of clip-space triangle `in` behind NEAR_W off, writing the
+// corners left to `out` in the same winding. Corners made on the cut get w of
+// exactly NEAR_W. Returns how many there are: 0, 3 or 4.
+u32 clip_to_near(const vec4 *in, vec4 *out) {
+  u32 n = 0;
+  for (u32 k = 0; k < 3; k++) {
+    vec4 a = in[k];
+    vec4 b = in[(k + 1) % 3];
+    if (a.w >= NEAR_W) out[n++] = a;
+    if ((a.w >= NEAR_W) != (b.w >= NEAR_W)) {
+      // lerp4 weighs its first argument by t.
+      out[n] = lerp4(b, a, (NEAR_W - a.w) / (b.w - a.w));
+      out[n++].w = NEAR_W;
+    }
+  }
+  return n < 3 ? 0 : n;
+}
+
+// Clips `t` with clip_to_near and appends what is left to rs.clipped as a
+// fan, its corners added to the end of rs.screen. Returns the number of
+// triangles appended.
+u32 clip_near(render_state& rs, bsp_view& bsp, const triangle& t) {
+  vec4 in[3] = {
+    mul4(to_3_4h(bsp.points[t.p0]), rs.view),
+    mul4(to_3_4h(bsp.points[t.p1]), rs.view),
+    mul4(to_3_4h(bsp.points[t.p2]), rs.view)
+  };
+  vec4 out[4];
+  u32 n = clip_to_near(in, out);
+  if (!n) return 0;
+  u32 base = rs.screen.size();
+  for (u32 k = 0; k < n; k++) {
+    rs.screen.push_back(to_4h_2(out[k]));
+  }
+  for (u32 k = 1; k + 1 < n; k++) {
+    rs.clipped.push_back((triangle) { base, base + k, base + k + 1, t.color });
+  }
+  return n - 2;
+}
+
+// Triangle `i` as stream entries: itself when every corner was projected,
+// otherwise whatever clipping leaves of it.
+template <typename T>
+void stream_triangle(render_state& rs, bsp_view& bsp, const T *tris, u32 i) {
+  const triangle& t = wide_tri(tris[i]);
+  vec2 a = rs.screen[t.p0];
+  vec2 b = rs.screen[t.p1];
+  vec2 c = rs.screen[t.p2];
+  if (a.x == a.x && b.x == b.x && c.x == c.x) {
+    rs.stream.push_back(i);
+    return;
+  }
+  u32 first = rs.clipped.size();
+  u32 count = clip_near(rs, bsp, t);
+  for (u32 k = 0; k < count; k++) {
+    rs.stream.push_back((first + k) | STREAM_CLIPPED);
+  }
+}
+
+// Fills rs.stream in painter's order, or exactly reversed with
+// `nearest_first`. The stack holds subtrees still to visit and, tagged with
+// BSP_DRAW, nodes whose own triangles are due. Subtrees whose bounds are out
+// of view are dropped whole.
+template <typename N, typename T>
+void order_bsp(render_state& rs, bsp_view& bsp, const N *nodes, const T *tris, vec3 eye, bool nearest_first) {
+  rs.stream.clear();
+  if (!bsp.node_count) return;
+  std::vector<u32> stack = { 0 };
+  u32 visited = 0;
+  while (stack.size()) {
+    u32 top = stack.back();
+    stack.pop_back();
+    if (top & BSP_DRAW) {
+      const bsp_node& node = wide_node(nodes[top & ~BSP_DRAW]);
+      for (u32 i = 0; i < node.count; i++) {
+	stream_triangle(rs, bsp, tris, nearest_first ? node.first + node.count - 1 - i : node.first + i);
+      }
+      continue;
+    }
+    visited++;
+    const bsp_node& node = wide_node(nodes[top]);
+    if (!box_visible(rs.clip, node.lo, node.hi)) continue;
+    push_node(stack, node, top, eye, nearest_first);
+  }
+  rs.profile.values[PROFILE_NODES] += visited;
+  rs.profile.values[PROFILE_TRIANGLES] += rs.stream.size();
+}
+
+// Every point is projected exactly once per frame; the traversal then only
+// indexes rs.screen, however many triangles share a corner.
+void project_scene(render_state& rs, const vec3 *points, usize point_count, mat4 view) {
+  rs.screen.resize(point_count);
+  rs.clipped.clear();
+  if (!rs.pool || point_count < 2 * PROJECT_TASK_GRAIN) {
+    project_points(view, points, point_count, rs.screen.data());
+    return;
+  }
+  task_group group;
+  for (usize from = 0; from < point_count; from += PROJECT_TASK_GRAIN) {
+    usize count = MIN(PROJECT_TASK_GRAIN, point_count - from);
+    pool_spawn(*rs.pool, group, [&rs, points, view, from, count] {
+      project_points(view, points + from, count, rs.screen.data() + from);
+    });
+  }
+  pool_wait(*rs.pool, group);
+}
+
+// Each tile keeps the stream's order, and a tile only ever writes its own
+// pixels, so the result is the same as drawing the stream on one thread. A
+// nearest-first stream stops a tile once every pixel in it is written.
+template <typename T>
+void raster_tiled(framebuffer& fb, render_state& rs, const T *tris) {
+  u32 tiles = fb.tiles_x * fb.tiles_y;
+  rs.bins.resize(tiles);
+  rs.tile_cover.resize(tiles);
+  rs.tile_pixels.resize(tiles);
+  for (u32 i = 0; i < tiles; i++) {
+    rs.bins[i].clear();
+  }
+  for (usize i = 0; i < rs.stream.size(); i++) {
+    const triangle& t = streamed(rs, tris, rs.stream[i]);
+    screen_rect r = triangle_bounds(rs.screen[t.p0], rs.screen[t.p1], rs.screen[t.p2], frame_rect(fb));
+    for (int ty = r.y0 / TILE_SIZE; ty * TILE_SIZE < r.y1; ty++) {
+      for (int tx = r.x0 / TILE_SIZE; tx * TILE_SIZE < r.x1; tx++) {
+	rs.bins[ty * fb.tiles_x + tx].push_back(rs.stream[i]);
+      }
+    }
+  }
+
+  task_group group;
+  for (u32 i = 0; i < tiles; i++) {
+    if (!rs.bins[i].size()) continue;
+    pool_spawn(*rs.pool, group, [&fb, &rs, tris, i] {
+      SDL_Rect r = tile_rect(fb, i);
+      screen_rect tile = (screen_rect) { r.x, r.y, r.x + r.w, r.y + r.h };
+      coverage *cov = NULL;
+      if (rs.nearest_first) {
+	cov = &rs.tile_cover[i];
+	coverage_reset(*cov, tile);
+      }
+      std::vector<u32>& bin = rs.bins[i];
+      u64 written = raster_pixels;
+      for (usize j = 0; j < bin.size() && !(cov && coverage_full(*cov)); j++) {
+	raster_triangle(fb, rs, tile, cov, streamed(rs, tris, bin[j]));
+      }
+      rs.tile_pixels[i] = raster_pixels - written;
+    });
+  }
+  pool_wait(*rs.pool, group);
+  for (u32 i = 0; i < tiles; i++) {
+    if (rs.bins[i].size()) rs.profile.values[PROFILE_PIXELS] += rs.tile_pixels[i];
+  }
+}
+
+// Front to back on one thread: nodes are visited as they are drawn, so the
+// walk ends as soon as the screen is covered.
+template <typename N, typename T>
+void draw_nearest_first(framebuffer& fb, render_state& rs, bsp_view& bsp, const N *nodes, const T *tris, vec3 eye) {
+  if (!bsp.node_count) return;
+  coverage_reset(rs.cover, frame_rect(fb));
+  std::vector<u32> stack = { 0 };
+  while (stack.size()) {
+    u32 top = stack.back();
+    stack.pop_back();
+    if (!(top & BSP_DRAW)) {
+      rs.profile.values[PROFILE_NODES]++;
+      const bsp_node& node = wide_node(nodes[top]);
+      if (box_visible(rs.clip, node.lo, node.hi)) {
+	push_node(stack, node, top, eye, true);
+      }
+      continue;
+    }
+    const bsp_node& node = wide_node(nodes[top & ~BSP_DRAW]);
+    for (u32 i = node.first + node.count; i-- > node.first;) {
+      rs.stream.clear();
+      stream_triangle(rs, bsp, tris, i);
+      rs.profile.values[PROFILE_TRIANGLES] += rs.stream.size();
+      for (usize j = 0; j < rs.stream.size(); j++) {
+	raster_triangle(fb, rs, frame_rect(fb), &rs.cover, streamed(rs, tris, rs.stream[j]));
+      }
+      if (coverage_full(rs.cover)) return;
+    }
+  }
+}
+
+template <typename N, typename T>
+void render_tree(framebuffer& fb, render_state& rs, bsp_view& bsp, const N *nodes, const T *tris, camera c) {
+  f32 *ms = rs.profile.values;
+  // The view translates by c.pos, so the eye sits at -c.pos in the world.
+  vec3 eye = mul3(c.pos, -1);
+  mat4 aspect = scale(cons3(1, (f32) fb.width / fb.height, 1));
+  rs.view = mul4x4(mul4x4(mul4x4(scale(cons3(fb.width, fb.height, 1)), c.view), mul4x4(aspect, perspective)), mul4x4(mul4x4(rotate(cons3(0, 0, c.rot.z)), rotate(cons3(0, c.rot.y, 0))), translate(c.pos)));
+  rs.clip = view_frustum(rs.view, frame_rect(fb));
+  {
+    scoped_timer t(&ms[PROFILE_PROJECT]);
+    project_scene(rs, bsp.points, bsp.point_count, rs.view);
+  }
+  if (rs.tiled && rs.pool) {
+    {
+      scoped_timer t(&ms[PROFILE_ORDER]);
+      order_bsp(rs, bsp, nodes, tris, eye, rs.nearest_first);
+    }
+    scoped_timer t(&ms[PROFILE_RASTER]);
+    raster_tiled(fb, rs, tris);
+  } else {
+    if (!rs.nearest_first) {
+      scoped_timer t(&ms[PROFILE_ORDER]);
+      order_bsp(rs, bsp, nodes, tris, eye, false);
+    }
+    scoped_timer t(&ms[PROFILE_RASTER]);
+    u64 written = raster_pixels;
+    if (rs.nearest_first) {
+      draw_nearest_first(fb, rs, bsp, nodes, tris, eye);
+    } else {
+      for (usize i = 0; i < rs.stream.size(); i++) {
+	raster_triangle(fb, rs, frame_rect(fb), NULL, streamed(rs, tris, rs.stream[i]));
+      }
+    }
+    ms[PROFILE_PIXELS] += raster_pixels - written;
+  }
+}
+
+// Times its stages and counts its work into rs.profile, which the caller
+// zeroes.
+void render_model(framebuffer& fb, render_state& rs, bsp_view& bsp, camera c) {
+  if (bsp.nodes16) {
+    render_tree(fb, rs, bsp, bsp.nodes16, bsp.tris16, c);
+  } else {
+    render_tree(fb, rs, bsp, bsp.nodes, bsp.tris, c);
+  }
+}
+
+// Turns the write counts an overdraw frame leaves in the drawn tiles into
+// colours: black where nothing was drawn, then blue, cyan, green, yellow and
+// orange up to red at six writes or more. The background has to be 0.
+void shade_overdraw(framebuffer& fb) {
+  static const u8 heat[7][3] = { { 0, 0, 0 }, { 0, 0, 255 }, { 0, 192, 255 }, { 0, 224, 0 }, { 255, 255, 0 }, { 255, 128, 0 }, { 255, 0, 0 } };
+  u32 colors[7];
+  for (u32 k = 0; k < 7; k++) {
+    colors[k] = SDL_MapRGB(fb.format, heat[k][0], heat[k][1], heat[k][2]);
+  }
+  for (u32 t = 0; t < fb.drawn.size(); t++) {
+    if (!fb.drawn[t]) continue;
+    SDL_Rect r = tile_rect(fb, t);
+    for (int y = r.y; y < r.y + r.h; y++) {
+      u32 *row = frame_row(fb, y);
+      for (int x = r.x; x < r.x + r.w; x++) {
+	row[x] = colors[MIN(row[x], 6)];
+      }
+    }
+  }
+}
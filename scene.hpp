@@ -0,0 +1,399 @@
+#pragma once
+
+#include <string.h>
+#include <memory>
+#include <vector>
+#include "utilities.hpp"
+#include "tasks.hpp"
+#include "bsp.hpp"
+#include "project.hpp"
+
+#define NAME_LEN 32
+
+// A model's geometry. Scene jobs share it with the editor, which copies it
+// through edit_mesh before changing it while a job still holds it.
+typedef struct model_mesh {
+  std::vector<vec3> points;
+  std::vector<triangle> tris;
+} model_mesh;
+
+// A model's own BSP in model space, with its split vertices appended to a
+// copy of the mesh's points, and the mesh's bounds. It is never changed once
+// built, so the editor and scene jobs share it. Kept compacted to 16-bit
+// indices when it is small enough.
+typedef struct model_tree {
+  std::vector<vec3> points;
+  bsp_tree tree;
+  vec3 lo, hi;
+} model_tree;
+
+typedef struct model {
+  char name[NAME_LEN];
+  std::shared_ptr<model_mesh> mesh;
+  vec3 pos;
+  vec3 rot;
+  vec3 scale;
+  mat4 matrix;
+  bool edit_vert;
+  bool edit_face;
+  // Transforms reuse the local tree; geometry edits clear `built`.
+  std::shared_ptr<const model_tree> local;
+  bool built;
+} model;
+
+mat4 model_matrix(model& m) {
+  return mul4x4(mul4x4(scale(m.scale), rotate(m.rot)), translate(m.pos));
+}
+
+// Every field is spelled out, so one added later cannot be left zeroed here
+// without a warning.
+model new_model(const char *name, std::vector<vec3> points, std::vector<triangle> tris, vec3 pos) {
+  std::shared_ptr<model_mesh> mesh = std::make_shared<model_mesh>((model_mesh) { std::move(points), std::move(tris) });
+  model m = (model) { "", mesh, pos, cons3(0, 0, 0), cons3(1, 1, 1), identity, false, false, NULL, false };
+  strncpy(m.name, name, NAME_LEN - 1);
+  m.matrix = model_matrix(m);
+  return m;
+}
+
+// The mesh to change, copied first when a scene job still shares it. Only
+// the editor thread calls this, and jobs only ever drop their copies, so a
+// count of one means nobody else holds it.
+model_mesh& edit_mesh(model& m) {
+  if (m.mesh.use_count() > 1) {
+    m.mesh = std::make_shared<model_mesh>(*m.mesh);
+  }
+  return *m.mesh;
+}
+
+vec3 transform_point(vec3 p, mat4 m) {
+  return to_4_3(mul4(to_3_4h(p), m));
+}
+
+// Hashes everything a model contributes to the scene's geometry.
+u64 model_key(u64 h, model& m) {
+  model_mesh& mesh = *m.mesh;
+  u64 counts[2] = { mesh.points.size(), mesh.tris.size() };
+  h = hash_bytes(h, counts, sizeof(counts));
+  h = hash_bytes(h, mesh.points.data(), mesh.points.size() * sizeof(vec3));
+  h = hash_bytes(h, mesh.tris.data(), mesh.tris.size() * sizeof(triangle));
+  h = hash_bytes(h, &m.pos, sizeof(vec3));
+  h = hash_bytes(h, &m.rot, sizeof(vec3));
+  h = hash_bytes(h, &m.scale, sizeof(vec3));
+  return h;
+}
+
+// Appends one model in world space, its triangles indexing after `points`.
+void flatten_model(model& m, std::vector<vec3>& points, std::vector<triangle>& tris) {
+  model_mesh& mesh = *m.mesh;
+  u32 offset = points.size();
+  points.resize(offset + mesh.points.size());
+  transform_points(m.matrix, mesh.points.data(), mesh.points.size(), points.data() + offset);
+  tris.reserve(tris.size() + mesh.tris.size());
+  for (usize j = 0; j < mesh.tris.size(); j++) {
+    triangle t = mesh.tris[j];
+    tris.push_back((triangle) { t.p0 + offset, t.p1 + offset, t.p2 + offset, t.color });
+  }
+}
+
+// Replaces the model's local tree with a fresh one. Leaves `built` clear, and
+// the old tree in place, when the build is cancelled.
+void build_model(model& m, bsp_options options, task_pool *pool, bsp_progress *progress) {
+  model_mesh& mesh = *m.mesh;
+  std::shared_ptr<model_tree> t = std::make_shared<model_tree>();
+  t->points = mesh.points;
+  t->tree = generate_bsp(t->points, mesh.tris, options, pool, progress);
+  if (progress_cancelled(progress)) return;
+  compact_bsp(t->tree, t->points.size());
+  t->lo = t->hi = mesh.points.size() ? mesh.points[0] : cons3(0, 0, 0);
+  for (usize i = 1; i < mesh.points.size(); i++) {
+    vec3 p = mesh.points[i];
+    t->lo = cons3(MIN(t->lo.x, p.x), MIN(t->lo.y, p.y), MIN(t->lo.z, p.z));
+    t->hi = cons3(MAX(t->hi.x, p.x), MAX(t->hi.y, p.y), MAX(t->hi.z, p.z));
+  }
+  m.local = t;
+  m.built = true;
+}
+
+// Moves a model-space plane into world space: a point on the world side of
+// plane * inverse lies on the same side of `plane` in model space, so front
+// stays front. `flip` turns it round for mirroring transforms, so it faces
+// the way the world-space triangles wind, as if the BSP had been built from
+// them.
+vec4 transform_plane(vec4 plane, mat4 inverse, bool flip) {
+  vec4 world = add4(add4(mul4(inverse.x, plane.x), mul4(inverse.y, plane.y)), add4(mul4(inverse.z, plane.z), mul4(inverse.w, plane.w)));
+  f32 l = hypot3(cons3(world.x, world.y, world.z));
+  if (l > 0) {
+    world = div4(world, flip ? -l : l);
+  }
+  return world;
+}
+
+// Models whose bounds no plane separates, merged into one tree built in
+// world space. It is kept for as long as `key` matches.
+typedef struct scene_cluster {
+  u64 key;
+  std::vector<vec3> points;
+  bsp_tree tree;
+} scene_cluster;
+
+// Two-level scene. A few top-level nodes order the models against each other
+// with planes between their bounds; under them sit each model's local tree,
+// moved into world space, or a cluster's tree. Moving a model only redoes
+// the O(n) placement, never a build.
+typedef struct scene_tree {
+  std::vector<vec3> points;
+  bsp_tree tree;
+  std::vector<scene_cluster> clusters;
+  bsp_options options;
+} scene_tree;
+
+typedef struct scene_item {
+  u32 model;
+  vec3 lo, hi;
+} scene_item;
+
+// Replaces a box with the world-space box around it after `m`.
+void transform_bounds(vec3& lo, vec3& hi, mat4 m) {
+  vec3 c = transform_point(mul3(add3(lo, hi), 0.5), m);
+  vec3 e = mul3(sub3(hi, lo), 0.5);
+  vec3 r = cons3(
+    fabs(m.x.x) * e.x + fabs(m.x.y) * e.y + fabs(m.x.z) * e.z,
+    fabs(m.y.x) * e.x + fabs(m.y.y) * e.y + fabs(m.y.z) * e.z,
+    fabs(m.z.x) * e.x + fabs(m.z.y) * e.y + fabs(m.z.z) * e.z
+  );
+  lo = sub3(c, r);
+  hi = add3(c, r);
+}
+
+// A model's or a cluster's tree and where its arrays go in the scene.
+typedef struct scene_part {
+  u32 model, cluster; // one of the two is BSP_NONE
+  u32 point_base, node_base, tri_base;
+} scene_part;
+
+typedef struct scene_top {
+  u32 index;
+  bsp_node node;
+} scene_top;
+
+// The scene's layout, worked out before anything is copied so that the
+// output is sized once and parts can be filled in parallel.
+typedef struct scene_plan {
+  std::vector<scene_part> parts;
+  std::vector<scene_top> tops;
+  u32 points, nodes, tris;
+} scene_plan;
+
+u32 plan_part(scene_plan& plan, u32 model, u32 cluster, usize points, const bsp_tree& tree) {
+  plan.parts.push_back((scene_part) { model, cluster, plan.points, plan.nodes, plan.tris });
+  plan.points += points;
+  plan.nodes += bsp_node_count(tree);
+  plan.tris += bsp_tri_count(tree);
+  return plan.parts.back().node_base;
+}
+
+// Copies a part into its slots, its points moved by the model's matrix.
+void fill_part(scene_tree& out, std::vector<model>& models, scene_part& part) {
+  bool local = part.model != BSP_NONE;
+  const std::vector<vec3>& points = local ? models[part.model].local->points : out.clusters[part.cluster].points;
+  const bsp_tree& tree = local ? models[part.model].local->tree : out.clusters[part.cluster].tree;
+  mat4 m = local ? models[part.model].matrix : identity;
+  f32 det = det3x3(m);
+  mat4 inverse = det != 0 ? inverse_affine(m) : (mat4) {};
+  bool flip = det < 0;
+
+  if (local) {
+    transform_points(m, points.data(), points.size(), out.points.data() + part.point_base);
+  } else {
+    std::copy(points.begin(), points.end(), out.points.begin() + part.point_base);
+  }
+  bsp_node *nodes = out.tree.nodes.data() + part.node_base;
+  for (usize i = 0; i < bsp_node_count(tree); i++) {
+    bsp_node n = bsp_node_at(tree, i);
+    if (local) {
+      n.plane = transform_plane(n.plane, inverse, flip);
+      transform_bounds(n.lo, n.hi, m);
+    }
+    if (flip) std::swap(n.front, n.back);
+    n.first += part.tri_base;
+    if (n.front != BSP_NONE) n.front += part.node_base;
+    if (n.back != BSP_NONE) n.back += part.node_base;
+    nodes[i] = n;
+  }
+  triangle *tris = out.tree.tris.data() + part.tri_base;
+  u32 base = part.point_base;
+  for (usize i = 0; i < bsp_tri_count(tree); i++) {
+    triangle t = bsp_tri_at(tree, i);
+    tris[i] = (triangle) { t.p0 + base, t.p1 + base, t.p2 + base, t.color };
+  }
+}
+
+// Ties go by model so that sorting twice gives the same order.
+void sort_items(std::vector<scene_item>& items, usize axis) {
+  std::sort(items.begin(), items.end(), [axis](const scene_item& a, const scene_item& b) {
+    f32 la = (&a.lo.x)[axis];
+    f32 lb = (&b.lo.x)[axis];
+    return la < lb || (la == lb && a.model < b.model);
+  });
+}
+
+// Looks for an axis-aligned plane with whole items on either side, taking the
+// most even split. Returns the number of items in front after sorting them so
+// those come last, or 0 when every plane cuts through some item.
+usize separate_items(std::vector<scene_item>& items, vec4& plane) {
+  usize best = 0;
+  usize best_axis = 0;
+  f32 best_at = 0;
+  for (usize axis = 0; axis < 3; axis++) {
+    sort_items(items, axis);
+    f32 reach = (&items[0].hi.x)[axis];
+    for (usize k = 1; k < items.size(); k++) {
+      f32 lo = (&items[k].lo.x)[axis];
+      usize front = items.size() - k;
+      if (reach <= lo && (!best || MIN(k, front) > MIN(items.size() - best, best))) {
+	best = front;
+	best_axis = axis;
+	best_at = (reach + lo) * 0.5;
+      }
+      reach = MAX(reach, (&items[k].hi.x)[axis]);
+    }
+  }
+  if (!best) return 0;
+  sort_items(items, best_axis);
+  f32 n[3] = { 0, 0, 0 };
+  n[best_axis] = 1;
+  plane = cons4(n[0], n[1], n[2], -best_at);
+  return best;
+}
+
+// Lays out the items under one subtree and returns its root. Children always
+// come after their parent.
+u32 place_items(scene_plan& plan, scene_tree& out, std::vector<scene_cluster>& old, std::vector<model>& models, std::vector<scene_item> items, task_pool *pool, bsp_progress *progress) {
+  if (items.size() == 1) {
+    model& m = models[items[0].model];
+    return plan_part(plan, items[0].model, BSP_NONE, m.local->points.size(), m.local->tree);
+  }
+
+  vec4 plane;
+  usize front = separate_items(items, plane);
+  if (front) {
+    usize top = plan.tops.size();
+    u32 index = plan.nodes++;
+    plan.tops.push_back((scene_top) { index, (bsp_node) { plane, 0, 0, BSP_NONE, BSP_NONE, cons3(0, 0, 0), cons3(0, 0, 0) } });
+    std::vector<scene_item> back_items(items.begin(), items.end() - front);
+    std::vector<scene_item> front_items(items.end() - front, items.end());
+    u32 b = place_items(plan, out, old, models, back_items, pool, progress);
+    u32 f = place_items(plan, out, old, models, front_items, pool, progress);
+    plan.tops[top].node.back = b;
+    plan.tops[top].node.front = f;
+    return index;
+  }
+
+  std::sort(items.begin(), items.end(), [](const scene_item& a, const scene_item& b) {
+    return a.model < b.model;
+  });
+  u64 key = hash_bytes(0xcbf29ce484222325ull, &out.options, sizeof(bsp_options));
+  for (usize i = 0; i < items.size(); i++) {
+    key = model_key(key, models[items[i].model]);
+  }
+  usize c = 0;
+  while (c < old.size() && old[c].key != key) c++;
+  if (c == old.size()) {
+    scene_cluster fresh = {};
+    fresh.key = key;
+    std::vector<triangle> tris = {};
+    for (usize i = 0; i < items.size(); i++) {
+      flatten_model(models[items[i].model], fresh.points, tris);
+    }
+    fresh.tree = generate_bsp(fresh.points, tris, out.options, pool, progress);
+    old.push_back(std::move(fresh));
+  }
+  out.clusters.push_back(std::move(old[c]));
+  old.erase(old.begin() + c);
+  scene_cluster& cl = out.clusters.back();
+  return plan_part(plan, BSP_NONE, out.clusters.size() - 1, cl.points.size(), cl.tree);
+}
+
+// Rebuilds the scene from each model's local tree, building only the ones
+// whose geometry or build options changed since the last time. Reads each
+// model's matrix as it is, so callers refresh it when a transform changes.
+// Returns false, with `out` still holding the previous scene, when `progress`
+// is cancelled; models that finished building keep their trees.
+bool assemble_scene(scene_tree& out, std::vector<model>& models, bsp_options options, task_pool *pool, bsp_progress *progress) {
+  bool same_options = !memcmp(&out.options, &options, sizeof(bsp_options));
+  bsp_options previous = out.options;
+  std::vector<scene_cluster> old = {};
+  if (same_options) old.swap(out.clusters);
+  out.clusters.clear();
+  out.options = options;
+
+  task_group group;
+  for (usize i = 0; i < models.size(); i++) {
+    model& m = models[i];
+    if (m.built && same_options) continue;
+    if (pool) {
+      pool_spawn(*pool, group, [&m, options, pool, progress] { build_model(m, options, pool, progress); });
+    } else {
+      build_model(m, options, pool, progress);
+    }
+  }
+  if (pool) pool_wait(*pool, group);
+  if (progress_cancelled(progress)) {
+    // Trees built under new options must not pass for ones built under the
+    // old.
+    for (usize i = 0; i < models.size() && !same_options; i++) {
+      models[i].built = false;
+    }
+    out.clusters.swap(old);
+    out.options = previous;
+    return false;
+  }
+
+  std::vector<scene_item> items = {};
+  for (usize i = 0; i < models.size(); i++) {
+    model& m = models[i];
+    if (!bsp_node_count(m.local->tree)) continue;
+    scene_item item = (scene_item) { (u32) i, cons3(INFINITY, INFINITY, INFINITY), cons3(-INFINITY, -INFINITY, -INFINITY) };
+    for (u32 k = 0; k < 8; k++) {
+      vec3 lo = m.local->lo, hi = m.local->hi;
+      vec3 p = transform_point(cons3(k & 1 ? hi.x : lo.x, k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z), m.matrix);
+      item.lo = cons3(MIN(item.lo.x, p.x), MIN(item.lo.y, p.y), MIN(item.lo.z, p.z));
+      item.hi = cons3(MAX(item.hi.x, p.x), MAX(item.hi.y, p.y), MAX(item.hi.z, p.z));
+    }
+    items.push_back(item);
+  }
+
+  scene_plan plan = {};
+  if (items.size()) place_items(plan, out, old, models, items, pool, progress);
+  // Clusters cut short hold empty trees under keys that would match again.
+  if (progress_cancelled(progress)) {
+    out.clusters.clear();
+    out.options = previous;
+    return false;
+  }
+  out.points.resize(plan.points);
+  out.tree.nodes.resize(plan.nodes);
+  out.tree.tris.resize(plan.tris);
+  for (usize i = 0; i < plan.tops.size(); i++) {
+    out.tree.nodes[plan.tops[i].index] = plan.tops[i].node;
+  }
+  for (usize i = 0; i < plan.parts.size(); i++) {
+    if (pool && plan.parts.size() > 1) {
+      pool_spawn(*pool, group, [&out, &models, &plan, i] { fill_part(out, models, plan.parts[i]); });
+    } else {
+      fill_part(out, models, plan.parts[i]);
+    }
+  }
+  if (pool) pool_wait(*pool, group);
+
+  // Top-level nodes were planned parent first, so their children are done
+  // by the time the walk back reaches them.
+  for (usize i = plan.tops.size(); i-- > 0;) {
+    bsp_node& n = out.tree.nodes[plan.tops[i].index];
+    bsp_node& f = out.tree.nodes[n.front];
+    bsp_node& b = out.tree.nodes[n.back];
+    n.lo = cons3(MIN(f.lo.x, b.lo.x), MIN(f.lo.y, b.lo.y), MIN(f.lo.z, b.lo.z));
+    n.hi = cons3(MAX(f.hi.x, b.hi.x), MAX(f.hi.y, b.hi.y), MAX(f.hi.z, b.hi.z));
+  }
+  return true;
+}
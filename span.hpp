@@ -0,0 +1,26 @@
+#pragma once
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "utilities.hpp"
+
+// Stores `color` into `count` consecutive pixels.
+void fill_pixels(u32 *dst, int count, u32 color) {
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i color8 = _mm256_set1_epi32(color);
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_si256((__m256i *) (dst + i), color8);
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i color4 = _mm_set1_epi32(color);
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128((__m128i *) (dst + i), color4);
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = color;
+  }
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "utilities.hpp"
+
+// Work-stealing task pool. Every worker owns a deque; it pushes and pops its
+// own work at the back and steals from the front of everyone else's. Threads
+// that are not workers (the UI thread) share one extra deque.
+
+typedef struct task_group {
+  std::atomic<u32> pending{0};
+} task_group;
+
+typedef struct task {
+  std::function<void()> fn;
+  task_group *group;
+} task;
+
+typedef struct task_queue {
+  std::mutex lock;
+  std::deque<task> tasks;
+} task_queue;
+
+typedef struct task_pool {
+  std::vector<std::thread> threads;
+  std::unique_ptr<task_queue[]> queues;
+  u32 queue_count;
+  std::atomic<u32> queued{0};
+  std::atomic<bool> stop{false};
+  std::mutex sleep_lock;
+  std::condition_variable wake;
+} task_pool;
+
+thread_local u32 pool_slot = (u32) -1;
+
+bool pool_pop(task_pool& p, task& t) {
+  u32 own = pool_slot < p.queue_count ? pool_slot : p.queue_count - 1;
+  {
+    task_queue& q = p.queues[own];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tasks.size()) {
+      t = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      p.queued--;
+      return true;
+    }
+  }
+  for (u32 i = 1; i < p.queue_count; i++) {
+    task_queue& q = p.queues[(own + i) % p.queue_count];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tasks.size()) {
+      t = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      p.queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void pool_run(task& t) {
+  t.fn();
+  t.group->pending--;
+}
+
+void pool_worker(task_pool& p, u32 slot) {
+  pool_slot = slot;
+  task t;
+  while (!p.stop) {
+    if (pool_pop(p, t)) {
+      pool_run(t);
+    } else {
+      std::unique_lock<std::mutex> guard(p.sleep_lock);
+      p.wake.wait(guard, [&] { return p.stop || p.queued; });
+    }
+  }
+}
+
+void pool_init(task_pool& p, u32 threads) {
+  p.queue_count = threads + 1;
+  p.queues.reset(new task_queue[p.queue_count]);
+  for (u32 i = 0; i < threads; i++) {
+    p.threads.push_back(std::thread(pool_worker, std::ref(p), i));
+  }
+}
+
+void pool_destroy(task_pool& p) {
+  {
+    std::lock_guard<std::mutex> guard(p.sleep_lock);
+    p.stop = true;
+  }
+  p.wake.notify_all();
+  for (usize i = 0; i < p.threads.size(); i++) {
+    p.threads[i].join();
+  }
+  p.threads.clear();
+}
+
+void pool_spawn(task_pool& p, task_group& g, std::function<void()> fn) {
+  u32 own = pool_slot < p.queue_count ? pool_slot : p.queue_count - 1;
+  g.pending++;
+  {
+    std::lock_guard<std::mutex> guard(p.sleep_lock);
+    p.queued++;
+  }
+  {
+    task_queue& q = p.queues[own];
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.tasks.push_back((task) { std::move(fn), &g });
+  }
+  p.wake.notify_one();
+}
+
+// Blocks until every task spawned into `g` has finished, running queued work
+// in the meantime so that nested waits cannot starve the pool. That work can
+// be anyone's, so a thread that must not stall should wait on a pool nobody
+// queues long tasks on.
+void pool_wait(task_pool& p, task_group& g) {
+  task t;
+  while (g.pending) {
+    if (pool_pop(p, t)) {
+      pool_run(t);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+#define CHUNK_BITS 14
+#define CHUNK_COUNT 4096
+
+// Append-only storage several threads can reserve slots in at once. Slots
+// never move, so a reader only needs a happens-before with the slot's writer.
+template <typename T>
+struct chunk_store {
+  std::atomic<u32> next{0};
+  std::atomic<T *> chunks[CHUNK_COUNT]{};
+};
+
+template <typename T>
+T& chunk_at(chunk_store<T>& s, u32 i) {
+  return s.chunks[i >> CHUNK_BITS].load(std::memory_order_relaxed)[i & ((1 << CHUNK_BITS) - 1)];
+}
+
+// Returns the first of `count` fresh slots. The table never grows, so
+// running out of chunks stops the program rather than writing past it.
+template <typename T>
+u32 chunk_reserve(chunk_store<T>& s, u32 count) {
+  u32 start = s.next.fetch_add(count);
+  if ((u64) start + count > (u64) CHUNK_COUNT << CHUNK_BITS) {
+    fprintf(stderr, "chunk_reserve: %llu slots, a store holds %u\n", (unsigned long long) start + count, CHUNK_COUNT << CHUNK_BITS);
+    abort();
+  }
+  for (u32 c = start >> CHUNK_BITS; count && c <= (start + count - 1) >> CHUNK_BITS; c++) {
+    T *data = s.chunks[c].load();
+    if (!data) {
+      T *fresh = new T[1 << CHUNK_BITS];
+      if (!s.chunks[c].compare_exchange_strong(data, fresh)) {
+	delete[] fresh;
+      }
+    }
+  }
+  return start;
+}
+
+template <typename T>
+void chunk_free(chunk_store<T>& s) {
+  for (u32 c = 0; c < CHUNK_COUNT; c++) {
+    delete[] s.chunks[c].exchange(NULL);
+  }
+  s.next = 0;
+}
+
+#define TRIPLE_FRESH 4u
+
+// Single-writer, single-reader handoff of the latest value. Each side owns a
+// slot of its own and trades it for the middle one with one atomic exchange,
+// so neither ever waits on the other. The reader only sees whole values, and
+// skips any the writer replaced before it looked.
+template <typename T>
+struct triple_buffer {
+  T slots[3];
+  std::atomic<u32> middle{1}; // slot index, | TRIPLE_FRESH when unread
+  u32 back = 0;
+  u32 front = 2;
+};
+
+// The slot the writer fills before triple_publish.
+template <typename T>
+T& triple_back(triple_buffer<T>& b) {
+  return b.slots[b.back];
+}
+
+template <typename T>
+void triple_publish(triple_buffer<T>& b) {
+  b.back = b.middle.exchange(b.back | TRIPLE_FRESH, std::memory_order_acq_rel) & ~TRIPLE_FRESH;
+}
+
+// Moves the reader onto the newest published value. False, with the front
+// slot untouched, when nothing was published since the last call.
+template <typename T>
+bool triple_acquire(triple_buffer<T>& b) {
+  if (!(b.middle.load(std::memory_order_relaxed) & TRIPLE_FRESH)) return false;
+  b.front = b.middle.exchange(b.front, std::memory_order_acq_rel) & ~TRIPLE_FRESH;
+  return true;
+}
@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 
@@ -14,6 +15,8 @@ typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int32_t i32;
+typedef int64_t i64;
 typedef size_t usize;
 typedef float f32;
 typedef double f64;
@@ -35,6 +38,27 @@ bool near_0(f32 n) {
   return n < std::nextafter(0, 1) && n > std::nextafter(0, -1);
 }
 
+u32 xorshift32(u32& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// FNV-1a over 64-bit words, bytes for the tail.
+u64 hash_bytes(u64 h, const void *data, usize size) {
+  const u8 *p = (const u8 *) data;
+  for (; size >= 8; p += 8, size -= 8) {
+    u64 w;
+    std::memcpy(&w, p, 8);
+    h = (h ^ w) * 0x100000001b3ull;
+  }
+  for (; size; p++, size--) {
+    h = (h ^ *p) * 0x100000001b3ull;
+  }
+  return h;
+}
+
 f32 dist(f32 a, f32 b) {
   return abs(a - b);
 }
@@ -188,6 +212,23 @@ mat4 scale(vec3 v) {
   );
 }
 
+// Determinant of the upper 3x3, the part that acts on directions.
+f32 det3x3(mat4 m) {
+  return m.x.x * (m.y.y * m.z.z - m.y.z * m.z.y) - m.x.y * (m.y.x * m.z.z - m.y.z * m.z.x) + m.x.z * (m.y.x * m.z.y - m.y.y * m.z.x);
+}
+
+// Inverse of a matrix whose last row is 0 0 0 1. `m` must not be singular.
+mat4 inverse_affine(mat4 m) {
+  f32 d = 1 / det3x3(m);
+  vec4 x = cons4((m.y.y * m.z.z - m.y.z * m.z.y) * d, (m.x.z * m.z.y - m.x.y * m.z.z) * d, (m.x.y * m.y.z - m.x.z * m.y.y) * d, 0);
+  vec4 y = cons4((m.y.z * m.z.x - m.y.x * m.z.z) * d, (m.x.x * m.z.z - m.x.z * m.z.x) * d, (m.x.z * m.y.x - m.x.x * m.y.z) * d, 0);
+  vec4 z = cons4((m.y.x * m.z.y - m.y.y * m.z.x) * d, (m.x.y * m.z.x - m.x.x * m.z.y) * d, (m.x.x * m.y.y - m.x.y * m.y.x) * d, 0);
+  x.w = -(x.x * m.x.w + x.y * m.y.w + x.z * m.z.w);
+  y.w = -(y.x * m.x.w + y.y * m.y.w + y.z * m.z.w);
+  z.w = -(z.x * m.x.w + z.y * m.y.w + z.z * m.z.w);
+  return cons4x4(x, y, z, cons4(0, 0, 0, 1));
+}
+
 vec2 to_3_2(vec3 v) {
   return cons2(v.x, v.y);
 }
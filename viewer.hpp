@@ -0,0 +1,218 @@
+#pragma once
+
+#include <SDL.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "utilities.hpp"
+#include "tasks.hpp"
+#include "bsp.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "mapped.hpp"
+#include "profile.hpp"
+
+// Rasterizes the render window on a thread of its own, so a slow frame never
+// holds up the editor and the editor's vsync never holds up the view. The
+// editor hands over immutable snapshots and never touches what it published.
+// SDL only lets the main thread touch the window, so finished frames come back
+// through `shown` and the editor puts them on screen with viewer_present.
+
+// A compiled scene that outlives the editor's next build: either copies of the
+// assembled arrays or a mapped cache file. Freed by whichever side drops the
+// last reference.
+typedef struct frame_scene {
+  std::vector<vec3> points;
+  bsp_tree tree;
+  mapped_file file;
+  bsp_view view;
+} frame_scene;
+
+void free_frame_scene(frame_scene *s) {
+  unmap_file(s->file);
+  delete s;
+}
+
+std::shared_ptr<frame_scene> new_frame_scene() {
+  return std::shared_ptr<frame_scene>(new frame_scene(), free_frame_scene);
+}
+
+// The editor keeps assembling into `world`, so the snapshot takes copies,
+// compacted to 16-bit indices when the scene is small enough.
+std::shared_ptr<frame_scene> copy_scene(scene_tree& world) {
+  std::shared_ptr<frame_scene> s = new_frame_scene();
+  s->points = world.points;
+  s->tree = world.tree;
+  compact_bsp(s->tree, s->points.size());
+  s->view = view_bsp(s->points, s->tree);
+  return s;
+}
+
+// Everything one frame is drawn from.
+typedef struct frame_snapshot {
+  camera c;
+  u32 raster;
+  bool tiled;
+  bool nearest_first;
+  bool overdraw;
+  f32 render_scale; // of the window's size, when not `auto_scale`
+  bool auto_scale;  // pick the scale that holds target_ms
+  f32 target_ms;
+  bool bilinear;    // filter frames smaller than the window
+  std::shared_ptr<frame_scene> scene;
+} frame_snapshot;
+
+typedef struct viewer {
+  SDL_Window *window;          // main thread only
+  SDL_Surface *surface;        // main thread only
+  std::vector<SDL_Rect> rects; // what viewer_present last copied out
+  framebuffer fb;              // drawn into by the viewer thread
+  std::mutex present_lock;
+  framebuffer shown;           // the last finished frames at window size, under present_lock
+  f32 scale;                   // the automatic scale
+  f32 frame_ms;                // smoothed, what the automatic scale follows
+  task_pool *pool;
+  triple_buffer<frame_snapshot> frames;
+  std::mutex profile_lock;
+  profile_history profile; // of the frames drawn, under profile_lock
+  std::atomic<bool> stop{false};
+  std::thread thread;
+} viewer;
+
+// Whether two snapshots draw the same frame. The scene is compared by
+// identity: a rebuilt one is a new snapshot even when nothing moved.
+bool same_frame(const frame_snapshot& a, const frame_snapshot& b) {
+  return !memcmp(&a.c, &b.c, sizeof(camera)) && a.raster == b.raster && a.tiled == b.tiled
+    && a.nearest_first == b.nearest_first && a.overdraw == b.overdraw && a.render_scale == b.render_scale
+    && a.auto_scale == b.auto_scale && a.target_ms == b.target_ms && a.bilinear == b.bilinear && a.scene == b.scene;
+}
+
+// Pixel work goes with the square of the scale, so the scale moves by the
+// square root of how far the frame time is from the target: at most 10% down
+// or 5% up a frame, and not at all within 10% of the target, so that it does
+// not hunt between two sizes.
+f32 next_scale(f32 scale, f32 ms, f32 target) {
+  if (ms <= 0 || target <= 0 || fabs(ms - target) < 0.1f * target) return scale;
+  f32 step = MIN(MAX(sqrtf(target / ms), 0.9f), 1.05f);
+  return MIN(MAX(scale * step, RENDER_SCALE_MIN), 1.0f);
+}
+
+// Draws the newest snapshot as fast as it can, from the first one published
+// on. The editor publishes every frame it shows, so a snapshot that would
+// draw what the last frame drew, at the same size, is skipped.
+void viewer_loop(viewer& v) {
+  render_state rs = {};
+  rs.pool = v.pool;
+  bsp_view empty = {};
+  bool started = false;
+  frame_snapshot last = {}; // what v.fb holds, once `drawn`
+  bool drawn = false;
+  while (!v.stop) {
+    started |= triple_acquire(v.frames);
+    if (!started) {
+      SDL_Delay(1);
+      continue;
+    }
+    frame_snapshot& f = v.frames.slots[v.frames.front];
+    rs.raster = f.raster;
+    rs.tiled = f.tiled;
+    rs.nearest_first = f.nearest_first;
+    rs.overdraw = f.overdraw;
+    f32 scale = f.auto_scale ? v.scale : MIN(MAX(f.render_scale, RENDER_SCALE_MIN), 1.0f);
+    int width = render_size(v.shown.width, scale);
+    int height = render_size(v.shown.height, scale);
+    if (drawn && width == v.fb.width && height == v.fb.height && same_frame(f, last)) {
+      SDL_Delay(1);
+      continue;
+    }
+    if (width != v.fb.width || height != v.fb.height) {
+      framebuffer_free(v.fb);
+      framebuffer_init(v.fb, width, height, v.shown.format);
+    }
+    bool scaled = width != v.shown.width || height != v.shown.height;
+    rs.profile = (frame_profile) {};
+    f32 *ms = rs.profile.values;
+    {
+      scoped_timer frame(&ms[PROFILE_FRAME]);
+      {
+	scoped_timer t(&ms[PROFILE_CLEAR]);
+	frame_begin(v.fb, f.overdraw ? 0 : SDL_MapRGB(v.fb.format, (u8) (f.c.bg_col.x * 255), (u8) (f.c.bg_col.y * 255), (u8) (f.c.bg_col.z * 255)));
+      }
+      render_model(v.fb, rs, f.scene ? f.scene->view : empty, f.c);
+      if (f.overdraw) {
+	scoped_timer t(&ms[PROFILE_RASTER]);
+	shade_overdraw(v.fb);
+      }
+      // Tiles changed here stay changed in `shown` until the editor presents
+      // them, however many frames that takes.
+      scoped_timer t(&ms[PROFILE_PRESENT]);
+      std::lock_guard<std::mutex> guard(v.present_lock);
+      if (scaled) {
+	frame_upscale(v.fb, v.shown, f.bilinear, v.pool);
+      } else {
+	frame_copy(v.fb, v.shown);
+      }
+    }
+    ms[PROFILE_SCALE] = 100.0f * width / v.shown.width;
+    v.frame_ms = v.frame_ms > 0 ? 0.8f * v.frame_ms + 0.2f * ms[PROFILE_FRAME] : ms[PROFILE_FRAME];
+    if (f.auto_scale) {
+      v.scale = next_scale(v.scale, v.frame_ms, f.target_ms);
+    } else {
+      v.scale = scale;
+    }
+    last = f;
+    drawn = true;
+    std::lock_guard<std::mutex> guard(v.profile_lock);
+    profile_push(v.profile, rs.profile);
+  }
+}
+
+// A copy, so the editor can plot it without holding up the next frame.
+void viewer_profile(viewer& v, profile_history& out) {
+  std::lock_guard<std::mutex> guard(v.profile_lock);
+  out = v.profile;
+}
+
+// Puts the tiles the viewer finished since the last call on screen. Only the
+// main thread may call it.
+void viewer_present(viewer& v) {
+  {
+    std::lock_guard<std::mutex> guard(v.present_lock);
+    SDL_LockSurface(v.surface);
+    frame_present(v.shown, v.surface, v.rects);
+    SDL_UnlockSurface(v.surface);
+  }
+  if (v.rects.size()) {
+    SDL_UpdateWindowSurfaceRects(v.window, v.rects.data(), v.rects.size());
+  }
+}
+
+void viewer_start(viewer& v, SDL_Window *window, SDL_Surface *surface, task_pool *pool) {
+  v.window = window;
+  v.surface = surface;
+  framebuffer_init(v.fb, surface->w, surface->h, surface->format);
+  framebuffer_init(v.shown, surface->w, surface->h, surface->format);
+  frame_begin(v.shown, 0);
+  v.scale = 1;
+  v.frame_ms = 0;
+  v.pool = pool;
+  v.profile = (profile_history) {};
+  v.stop = false;
+  v.thread = std::thread(viewer_loop, std::ref(v));
+}
+
+// Only the editor thread may publish.
+void viewer_publish(viewer& v, frame_snapshot f) {
+  triple_back(v.frames) = std::move(f);
+  triple_publish(v.frames);
+}
+
+void viewer_stop(viewer& v) {
+  v.stop = true;
+  if (v.thread.joinable()) v.thread.join();
+  framebuffer_free(v.fb);
+  framebuffer_free(v.shown);
+}